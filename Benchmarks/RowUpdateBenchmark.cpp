@@ -0,0 +1,128 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+	Cost of PSTHTensor::addSpikes() for one trial over many rows, against the
+	per-bin prefix-sum update it replaced (a counter bumped inside the bin
+	loop). Configure with -DSYNCSINK_BUILD_BENCHMARKS=ON to build the
+	RowUpdateBenchmark target, at -O3 as the plugin is built on Linux.
+*/
+
+#include "../Source/PSTHTensor.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+/* the previous update: one pass over the row from the first spike, counting spikes as it goes */
+static void addSpikesPerBin(uint32* sums, const int* bins, int n_spikes, int n_bins)
+{
+	uint32 added = 0;
+	int next = 0;
+	for (int i = bins[0]; i < n_bins; i++)
+	{
+		while (next < n_spikes && bins[next] == i)
+		{
+			added++;
+			next++;
+		}
+		sums[i + 1] += added;
+	}
+}
+
+int main()
+{
+	const int nChannels = 1000;
+	const int nUnits = 4;
+	const int nTrials = 20;
+	PSTHBinning binning;
+	binning.binSize = 1;
+	binning.nBins = 1000;
+	binning.preBins = 200;
+	int nBins = binning.getRowLength();
+
+	std::mt19937 rng(5);
+	std::vector<std::vector<int>> rowBins(size_t(nChannels) * nUnits);
+	for (std::vector<int>& bins : rowBins)
+	{
+		bins.resize(1 + rng() % 40);
+		for (int& bin : bins)
+		{
+			bin = int(rng() % nBins);
+		}
+		std::sort(bins.begin(), bins.end());
+	}
+
+	std::vector<uint32> reference(rowBins.size() * (nBins + 1), 0);
+
+	/* the rows get their blocks in an untimed first trial, which the reference gets too */
+	PSTHTensor tensor;
+	tensor.setBinning(binning);
+	tensor.setNumConditions(1);
+	tensor.ensure(nChannels - 1, nUnits - 1);
+	{
+		PSTHTensor::WriteScope write(tensor);
+		for (size_t row = 0; row < rowBins.size(); row++)
+		{
+			tensor.addSpikes(int(row / nUnits), int(row % nUnits), 0, rowBins[row].data(), (int)rowBins[row].size());
+			addSpikesPerBin(reference.data() + row * (nBins + 1), rowBins[row].data(), (int)rowBins[row].size(), nBins);
+		}
+	}
+	auto t0 = std::chrono::steady_clock::now();
+	for (int trial = 0; trial < nTrials; trial++)
+	{
+		for (size_t row = 0; row < rowBins.size(); row++)
+		{
+			addSpikesPerBin(reference.data() + row * (nBins + 1), rowBins[row].data(), (int)rowBins[row].size(), nBins);
+		}
+	}
+
+	auto t1 = std::chrono::steady_clock::now();
+	for (int trial = 0; trial < nTrials; trial++)
+	{
+		PSTHTensor::WriteScope write(tensor);
+		for (size_t row = 0; row < rowBins.size(); row++)
+		{
+			tensor.addSpikes(int(row / nUnits), int(row % nUnits), 0, rowBins[row].data(), (int)rowBins[row].size());
+		}
+	}
+	auto t2 = std::chrono::steady_clock::now();
+
+	/* both must agree on every count */
+	bool same = true;
+	for (size_t row = 0; row < rowBins.size(); row++)
+	{
+		PSTHTensor::HistogramView view = tensor.getView(int(row / nUnits), int(row % nUnits), 0);
+		for (int bin = 0; bin < nBins; bin++)
+		{
+			const uint32* sums = reference.data() + row * (nBins + 1);
+			same = same && view.getCount(bin) == sums[bin + 1] - sums[bin];
+		}
+	}
+	std::printf("%zu rows x %d bins: per-bin %.2f ms/trial, addSpikes %.2f ms/trial%s\n", rowBins.size(), nBins,
+		std::chrono::duration<double, std::milli>(t1 - t0).count() / nTrials,
+		std::chrono::duration<double, std::milli>(t2 - t1).count() / nTrials,
+		same ? "" : " (counts differ!)");
+	return same ? 0 : 1;
+}
@@ -0,0 +1,131 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+	Audio-side cost of handing spikes to the engine: one command per spike,
+	as handleSpike() used to post them (with a sample rate lookup per
+	spike), against one SpikeBatch per process() block, stamped in one pass
+	and copied into the spike ring. Both include the engine draining the
+	queue. Configure with -DSYNCSINK_BUILD_BENCHMARKS=ON to build the
+	SpikeBatchBenchmark target, at -O3 as the plugin is built on Linux.
+*/
+
+#include "../Source/SyncSinkEngine.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+/* stands in for event->getChannelInfo()->getSampleRate(), a virtual call per spike */
+struct StreamInfo
+{
+	virtual ~StreamInfo() {}
+	virtual double getSampleRate() const { return 30000.0; }
+};
+
+/* the per-spike command: an engine command plus the spike's channel and unit */
+struct SpikeCommand
+{
+	EngineCommand command;
+	int channelIdx;
+	int sortedId;
+};
+
+int main()
+{
+	const double sampleRate = 30000.0;
+	const int spikesPerSecond = 100000;
+	const int seconds = 20;
+	const int blockSamples = 1024;
+	const int64 startTimestamp = 12345;
+	int nBlocks = int(seconds * sampleRate / blockSamples);
+	int spikesPerBlock = int(spikesPerSecond * blockSamples / sampleRate);
+
+	std::mt19937 rng(1);
+	std::vector<int> channels(spikesPerBlock);
+	std::vector<int> units(spikesPerBlock);
+	for (int i = 0; i < spikesPerBlock; i++)
+	{
+		channels[i] = rng() % 384;
+		units[i] = rng() % 4;
+	}
+	std::unique_ptr<StreamInfo> info = std::make_unique<StreamInfo>();
+	volatile int64 sink = 0;
+
+	SpscQueue<SpikeCommand> spikeQueue(1 << 16);
+	auto t0 = std::chrono::steady_clock::now();
+	for (int block = 0; block < nBlocks; block++)
+	{
+		int64 firstSample = int64(block) * blockSamples;
+		for (int i = 0; i < spikesPerBlock; i++)
+		{
+			SpikeCommand spike;
+			spike.command.sampleNumber = firstSample + i * blockSamples / spikesPerBlock;
+			spike.command.timestamp = (int64)((double)spike.command.sampleNumber / (info->getSampleRate() / 1000) + startTimestamp);
+			spike.channelIdx = channels[i];
+			spike.sortedId = units[i];
+			spikeQueue.push(spike);
+		}
+		while (SpikeCommand* spike = spikeQueue.front())
+		{
+			sink += spike->command.timestamp;
+			spikeQueue.pop();
+		}
+	}
+
+	SpscQueue<EngineCommand> batchQueue(1 << 16);
+	SpscByteQueue ring(1 << 22);
+	SpikeBatch batch;
+	std::vector<double> samplesPerMs(1, sampleRate / 1000);
+	auto t1 = std::chrono::steady_clock::now();
+	for (int block = 0; block < nBlocks; block++)
+	{
+		int64 firstSample = int64(block) * blockSamples;
+		for (int i = 0; i < spikesPerBlock; i++)
+		{
+			batch.add(channels[i], units[i], 0, firstSample + i * blockSamples / spikesPerBlock);
+		}
+		batch.stamp(samplesPerMs, startTimestamp);
+		size_t size = SpikeBatch::getRecordSize(batch.size());
+		EngineCommand command;
+		command.nSpikes = batch.size();
+		command.textPosition = ring.allocate(size);
+		command.textLength = (int)size;
+		batch.write(ring.at(command.textPosition));
+		batchQueue.push(command);
+		batch.clear();
+		while (EngineCommand* posted = batchQueue.front())
+		{
+			sink += SpikeBatch::read(ring.at(posted->textPosition), posted->nSpikes).timestamp[0];
+			ring.release(posted->textPosition, posted->textLength);
+			batchQueue.pop();
+		}
+	}
+	auto t2 = std::chrono::steady_clock::now();
+
+	double nSpikes = double(nBlocks) * spikesPerBlock;
+	std::printf("%.0f spikes: per-spike %.1f ns/spike, batched %.1f ns/spike\n", nSpikes,
+		std::chrono::duration<double, std::nano>(t1 - t0).count() / nSpikes,
+		std::chrono::duration<double, std::nano>(t2 - t1).count() / nSpikes);
+	return 0;
+}
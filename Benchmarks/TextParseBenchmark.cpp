@@ -0,0 +1,240 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+	Heap allocations and time per Kofiko text message on the engine thread:
+	the StringArray parser that handleBroadcastMessage() used to run (a
+	startsWith() chain, then every token copied into a heap string and the
+	image ids into a string -> string map), against KofikoMessage with the
+	ImageIndex and ConditionNames that applyTrialMessage() fills. The old
+	parser is stood in for by std::string, whose small-string buffer spares
+	the short tokens an allocation that a JUCE String makes, so its count is
+	a lower bound.
+
+	Each design is installed twice: the first pass grows the arenas, the
+	second (after a ClearDesign) reuses them, as every design after the
+	first one does in a session. Allocations are counted by replacing the
+	global operator new. Configure with -DSYNCSINK_BUILD_BENCHMARKS=ON to
+	build the TextParseBenchmark target, at -O3 as the plugin is built on
+	Linux.
+*/
+
+#include "../Source/KofikoMessage.h"
+#include "../Source/ImageIndex.h"
+#include "../Source/ConditionNames.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+static size_t allocations = 0;
+
+void* operator new(size_t size)
+{
+	allocations++;
+	if (void* p = std::malloc(size ? size : 1))
+	{
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	std::free(p);
+}
+
+/* the old parser, with std::string for String and StringArray */
+struct StringArrayParser
+{
+	std::unordered_map<std::string, std::string> conditionMap; // image id -> condition name
+	std::unordered_map<std::string, int> conditionList; // condition name -> stim class
+	int numConditions = 0;
+	int stimClass = -1;
+
+	static std::vector<std::string> tokenize(const std::string& message)
+	{
+		std::vector<std::string> tokens;
+		size_t start = message.find_first_not_of(" \t\r\n");
+		while (start != std::string::npos)
+		{
+			size_t end = message.find_first_of(" \t\r\n", start);
+			tokens.push_back(message.substr(start, end - start));
+			start = message.find_first_not_of(" \t\r\n", end);
+		}
+		return tokens;
+	}
+
+	static bool startsWith(const std::string& message, const char* word)
+	{
+		return message.compare(0, std::strlen(word), word) == 0;
+	}
+
+	void apply(const std::string& message)
+	{
+		if (startsWith(message, "ClearDesign"))
+		{
+			conditionMap.clear();
+			conditionList.clear();
+			numConditions = 0;
+		}
+		else if (startsWith(message, "AddCondition"))
+		{
+			std::vector<std::string> tokens = tokenize(message);
+			for (size_t i = 6; i < tokens.size(); i++)
+			{
+				conditionMap[tokens[i]] = tokens[2];
+			}
+			conditionList[tokens[2]] = numConditions++;
+		}
+		else if (startsWith(message, "TrialStart") || startsWith(message, "TrialType"))
+		{
+			std::vector<std::string> tokens = tokenize(message);
+			auto image = conditionMap.find(tokens[1]);
+			stimClass = image != conditionMap.end() ? conditionList[image->second] : -1;
+		}
+		else if (startsWith(message, "TrialAlign") || startsWith(message, "TrialEnd"))
+		{
+		}
+	}
+};
+
+/* applyTrialMessage() and applyAddCondition() without the trial state */
+struct KofikoParser
+{
+	ImageIndex imageIndex;
+	ConditionNames conditionNames;
+	int stimClass = -1;
+
+	void apply(std::string_view message)
+	{
+		KofikoMessage tokens(message);
+		TrialEvent::Type type;
+		if (!tokens.getType(type))
+		{
+			return;
+		}
+		switch (type)
+		{
+		case TrialEvent::CLEAR_DESIGN:
+			imageIndex.clear();
+			conditionNames.clear();
+			break;
+		case TrialEvent::ADD_CONDITION:
+		{
+			std::string_view name;
+			tokens.skip(1);
+			tokens.next(name);
+			tokens.skip(3);
+			std::string_view image;
+			while (tokens.next(image))
+			{
+				imageIndex.add(image, conditionNames.size());
+			}
+			conditionNames.add(name);
+			break;
+		}
+		case TrialEvent::TRIAL_START:
+		case TrialEvent::TRIAL_TYPE:
+		{
+			std::string_view image;
+			tokens.next(image);
+			stimClass = imageIndex.find(image);
+			break;
+		}
+		default:
+			break;
+		}
+	}
+};
+
+struct Result
+{
+	double nsPerMessage;
+	double allocationsPerMessage;
+};
+
+template <typename Parser>
+Result run(Parser& parser, const std::vector<std::string>& messages)
+{
+	size_t before = allocations;
+	auto t0 = std::chrono::steady_clock::now();
+	for (const std::string& message : messages)
+	{
+		parser.apply(message);
+	}
+	auto t1 = std::chrono::steady_clock::now();
+	return { std::chrono::duration<double, std::nano>(t1 - t0).count() / messages.size(),
+		double(allocations - before) / messages.size() };
+}
+
+int main()
+{
+	const int nConditions = 100;
+	const int imagesPerCondition = 2000;
+	const int nTrials = 200000;
+
+	std::vector<std::string> design(1, "ClearDesign");
+	for (int c = 0; c < nConditions; c++)
+	{
+		std::string message = "AddCondition Name Condition" + std::to_string(c) + " Visible 1 TrialTypes";
+		for (int i = 0; i < imagesPerCondition; i++)
+		{
+			message += " img" + std::to_string(c * imagesPerCondition + i);
+		}
+		design.push_back(message);
+	}
+	std::vector<std::string> trials;
+	for (int t = 0; t < nTrials; t++)
+	{
+		trials.push_back("TrialStart img" + std::to_string((t * 7919) % (nConditions * imagesPerCondition)));
+		trials.push_back("TrialAlign");
+		trials.push_back("TrialEnd");
+	}
+
+	StringArrayParser before;
+	KofikoParser after;
+	const char* passes[] = { "first design", "next design" };
+	for (const char* pass : passes)
+	{
+		Result old = run(before, design);
+		Result now = run(after, design);
+		std::printf("%-12s StringArray %8.0f ns %7.1f allocs/msg   KofikoMessage %8.0f ns %7.1f allocs/msg\n",
+			pass, old.nsPerMessage, old.allocationsPerMessage, now.nsPerMessage, now.allocationsPerMessage);
+	}
+	Result old = run(before, trials);
+	Result now = run(after, trials);
+	std::printf("%-12s StringArray %8.0f ns %7.1f allocs/msg   KofikoMessage %8.0f ns %7.1f allocs/msg\n",
+		"trials", old.nsPerMessage, old.allocationsPerMessage, now.nsPerMessage, now.allocationsPerMessage);
+	return (before.stimClass >= 0) == (after.stimClass >= 0) ? 0 : 1;
+}
@@ -0,0 +1,66 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ConditionNames.h"
+
+#include <charconv>
+#include <numeric>
+
+void ConditionNames::add(std::string_view name)
+{
+	if (name.empty())
+	{
+		char number[16];
+		char* end = std::to_chars(number, number + sizeof(number), size()).ptr;
+		arena.insert(arena.end(), number, end);
+	}
+	else
+	{
+		arena.insert(arena.end(), name.begin(), name.end());
+	}
+	ends.push_back(arena.size());
+}
+
+std::string_view ConditionNames::getName(int stim_class) const
+{
+	size_t begin = stim_class > 0 ? ends[stim_class - 1] : 0;
+	return std::string_view(arena.data() + begin, ends[stim_class] - begin);
+}
+
+std::vector<int> ConditionNames::getStimClasses() const
+{
+	std::vector<int> stimClasses(ends.size());
+	std::iota(stimClasses.begin(), stimClasses.end(), 0);
+	return stimClasses;
+}
+
+void ConditionNames::reserve(int n_conditions)
+{
+	ends.reserve(n_conditions);
+}
+
+void ConditionNames::clear()
+{
+	arena.clear();
+	ends.clear();
+}
@@ -0,0 +1,78 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef CONDITIONNAMES_H_DEFINED
+#define CONDITIONNAMES_H_DEFINED
+
+#include <ProcessorHeaders.h>
+
+#include <string_view>
+#include <vector>
+
+/**
+	Stim class names, indexed by stim class.
+
+	The names are copied back to back into a single character arena, so
+	adding one allocates nothing once the arena has grown to the size of
+	the design; clear() keeps the storage for the next design. The engine
+	publishes copies of it to the message thread (see
+	SyncSink::getConditionNames()).
+*/
+class ConditionNames
+{
+public:
+	/** Appends the name of the next stim class; an empty name stands for the stim class number */
+	void add(std::string_view name);
+
+	/** Number of stim classes */
+	int size() const { return int(ends.size()); }
+
+	/** Name of stim_class, which must be in range */
+	std::string_view getName(int stim_class) const;
+
+	/** Name of stim_class as a String, or "" if it is out of range */
+	String getLabel(int stim_class) const
+	{
+		if (stim_class < 0 || stim_class >= size())
+		{
+			return String();
+		}
+		std::string_view name = getName(stim_class);
+		return String::fromUTF8(name.data(), (int)name.size());
+	}
+
+	/** Stim classes 0 .. size() - 1 */
+	std::vector<int> getStimClasses() const;
+
+	/** Preallocates for n_conditions names */
+	void reserve(int n_conditions);
+
+	/** Drops every name, keeping the allocated storage */
+	void clear();
+
+private:
+	std::vector<char> arena;
+	std::vector<size_t> ends; // end of each name in arena
+};
+
+#endif // CONDITIONNAMES_H_DEFINED
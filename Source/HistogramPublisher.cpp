@@ -0,0 +1,269 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "HistogramPublisher.h"
+
+#include <zmq.h>
+
+static void writeLittleEndian(std::vector<uint8>& out, uint64 value, int n_bytes)
+{
+	for (int i = 0; i < n_bytes; i++)
+	{
+		out.push_back(uint8(value >> (8 * i)));
+	}
+}
+
+static void writeVarint(std::vector<uint8>& out, uint64 value)
+{
+	while (value >= 0x80)
+	{
+		out.push_back(uint8(value) | 0x80);
+		value >>= 7;
+	}
+	out.push_back(uint8(value));
+}
+
+static bool isSameLayout(const PSTHBinning& a, const PSTHBinning& b)
+{
+	return a.binSize == b.binSize && a.nBins == b.nBins && a.preBins == b.preBins;
+}
+
+HistogramPublisher::HistogramPublisher(void* context_)
+	: Thread("SyncSinkPublishThread"), context(context_)
+{
+	publishedBinning.nBins = 0;
+}
+
+HistogramPublisher::~HistogramPublisher()
+{
+	if (!stopThread(1000)) {
+		std::cerr << "Publish thread timeout." << std::endl;
+	}
+	closeSocket();
+}
+
+void HistogramPublisher::setEndpoint(const String& endpoint_)
+{
+	const ScopedLock lock(endpointLock);
+	endpoint = endpoint_.trim();
+	endpointChanged = true; // the publisher thread re-binds on its next loop
+}
+
+void HistogramPublisher::openSocket()
+{
+	closeSocket();
+	String address;
+	{
+		const ScopedLock lock(endpointLock);
+		address = endpoint;
+	}
+	if (address.isEmpty())
+	{
+		return;
+	}
+	socket = zmq_socket(context, ZMQ_XPUB);
+	/* pass every subscription up, repeated ones included: each is a keyframe request */
+	const int VERBOSE = 1;
+	zmq_setsockopt(socket, ZMQ_XPUB_VERBOSE, &VERBOSE, sizeof(VERBOSE));
+	int rc = zmq_bind(socket, address.toRawUTF8());
+	if (rc != 0)
+	{
+		std::cout << "HistogramPublisher::openSocket(): unable to bind " << address << ": " << zmq_strerror(zmq_errno()) << std::endl;
+		closeSocket();
+		return;
+	}
+	std::cout << "HistogramPublisher::openSocket(): publishing PSTHs on " << address << std::endl;
+	/* a new socket has no subscribers yet; the first one gets a keyframe */
+	publishedEpoch = 0;
+	active = true;
+	updateWanted = true;
+}
+
+void HistogramPublisher::closeSocket()
+{
+	active = false;
+	if (socket != nullptr)
+	{
+		const int LINGER = 0;
+		zmq_setsockopt(socket, ZMQ_LINGER, &LINGER, sizeof(LINGER));
+		zmq_close(socket);
+		socket = nullptr;
+	}
+}
+
+void HistogramPublisher::run()
+{
+	while (!threadShouldExit())
+	{
+		if (endpointChanged.exchange(false))
+		{
+			openSocket();
+		}
+		if (socket == nullptr)
+		{
+			wait(100);
+			continue;
+		}
+		/* a subscriber gets the state as of the last capture at once, and what
+		   changed since as a delta once the engine has answered the update request */
+		bool keyframe = takeSubscriptions();
+		if (keyframe)
+		{
+			updateWanted = true;
+		}
+		if (takeCapture() || keyframe)
+		{
+			publish(keyframe);
+		}
+		else
+		{
+			wait(5);
+		}
+	}
+	closeSocket();
+}
+
+bool HistogramPublisher::takeSubscriptions()
+{
+	bool subscribed = false;
+	uint8 frame[256];
+	int size;
+	while ((size = zmq_recv(socket, frame, sizeof(frame), ZMQ_DONTWAIT)) > 0)
+	{
+		/* 1 then the topic for a subscription, 0 for an unsubscription */
+		subscribed = subscribed || frame[0] == 1;
+	}
+	return subscribed;
+}
+
+void HistogramPublisher::update(const PSTHTensor& tensor)
+{
+	if (!active.load(std::memory_order_relaxed))
+	{
+		return;
+	}
+	updateWanted = false;
+	tensor.capture(captures[back]);
+	back = mailbox.exchange(back | fresh, std::memory_order_acq_rel) & ~fresh;
+	notify();
+}
+
+bool HistogramPublisher::takeCapture()
+{
+	if ((mailbox.load(std::memory_order_relaxed) & fresh) == 0)
+	{
+		return false;
+	}
+	front = mailbox.exchange(front, std::memory_order_acq_rel) & ~fresh;
+	return true;
+}
+
+void HistogramPublisher::publish(bool keyframe)
+{
+	const PSTHTensor::Capture& capture = captures[front];
+	const PSTHBinning& binning = capture.display;
+	int nBins = binning.getRowLength();
+	size_t nBlocks = capture.getNumBlocks();
+
+	/* block numbers, and so the state kept by block, hold until the epoch changes */
+	bool full = keyframe || capture.epoch != publishedEpoch || !isSameLayout(binning, publishedBinning)
+		|| capture.nChannels < publishedChannels || capture.nUnits < publishedUnits || capture.nConditions < publishedConditions;
+	if (full)
+	{
+		publishedVersions.assign(nBlocks, 0);
+		publishedCounts.assign(nBlocks * size_t(nBins), 0);
+	}
+	else
+	{
+		publishedVersions.resize(nBlocks, 0);
+		publishedCounts.resize(nBlocks * size_t(nBins), 0);
+	}
+	publishedEpoch = capture.epoch;
+	publishedBinning = binning;
+	publishedChannels = capture.nChannels;
+	publishedUnits = capture.nUnits;
+	publishedConditions = capture.nConditions;
+
+	message.clear();
+	message.insert(message.end(), { 'P', 'S', 'T', 'H', uint8(version), uint8(full ? KEYFRAME : DELTA), 0, 0 });
+	writeLittleEndian(message, sequence++, 8);
+	writeLittleEndian(message, uint32(binning.binSize), 4);
+	writeLittleEndian(message, uint32(binning.preBins), 4);
+	writeLittleEndian(message, uint32(nBins), 4);
+	writeLittleEndian(message, uint32(capture.trialCounts.size()), 4);
+	for (int n : capture.trialCounts)
+	{
+		writeVarint(message, uint64(n));
+	}
+	size_t countPosition = message.size();
+	writeLittleEndian(message, 0, 4);
+
+	/* only the blocks written since the last message are compared; rows without a block are empty */
+	uint32 nHistograms = 0;
+	for (size_t block = 0; block < nBlocks; block++)
+	{
+		const int32* row = capture.blockRows.data() + 3 * block;
+		if (row[0] < 0 || (publishedVersions[block] == capture.blockVersions[block] && !full))
+		{
+			continue;
+		}
+		publishedVersions[block] = capture.blockVersions[block];
+		uint32* last = publishedCounts.data() + block * size_t(nBins);
+		changes.clear();
+		int nChanged = 0;
+		int previous = -1;
+		for (int bin = 0; bin < nBins; bin++)
+		{
+			uint32 now = capture.getCount(block, bin);
+			if (now != last[bin])
+			{
+				int64 change = int64(now) - int64(last[bin]);
+				writeVarint(changes, uint64(bin - previous - 1));
+				writeVarint(changes, (uint64(change) << 1) ^ uint64(change >> 63));
+				previous = bin;
+				nChanged++;
+				last[bin] = now;
+			}
+		}
+		if (nChanged == 0)
+		{
+			continue;
+		}
+		writeVarint(message, uint64(row[0]));
+		writeVarint(message, uint64(row[1]));
+		writeVarint(message, uint64(row[2]));
+		writeVarint(message, uint64(nChanged));
+		message.insert(message.end(), changes.begin(), changes.end());
+		nHistograms++;
+	}
+	for (int i = 0; i < 4; i++)
+	{
+		message[countPosition + i] = uint8(nHistograms >> (8 * i));
+	}
+
+	/* XPUB drops for subscribers at their high-water mark instead of blocking */
+	if (zmq_send(socket, message.data(), message.size(), ZMQ_DONTWAIT) == -1)
+	{
+		std::cout << "HistogramPublisher::publish(): message " << sequence - 1 << " not sent: " << zmq_strerror(zmq_errno()) << std::endl;
+	}
+}
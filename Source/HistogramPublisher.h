@@ -0,0 +1,137 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef HISTOGRAMPUBLISHER_H_DEFINED
+#define HISTOGRAMPUBLISHER_H_DEFINED
+
+#include <ProcessorHeaders.h>
+
+#include "PSTHTensor.h"
+
+
+/**
+	Publishes the PSTHs to external dashboards on a ZMQ XPUB socket.
+
+	At TrialEnd the engine brings a PSTHTensor::Capture up to date
+	(update()), which only copies the blocks written since that capture was
+	last filled, and hands it over through a lock-free triple buffer. The
+	publisher thread then walks the allocated blocks of the newest capture
+	and sends one message holding the histograms whose counts changed since
+	its previous message. Sends never wait: a slow subscriber loses
+	messages at the high-water mark rather than hold up the publisher, let
+	alone the trial path.
+
+	Message layout (little-endian; varints are LEB128, signed ones zigzag):
+
+		0   char[4] "PSTH", the topic to subscribe to
+		4   uint8   version, 1
+		5   uint8   kind: 1 keyframe, 2 delta
+		6   uint16  reserved, 0
+		8   uint64  sequence number, one more than the previous message's
+		16  int32   bin size (ms)
+		20  int32   bins before TrialAlign
+		24  int32   bins per histogram
+		28  uint32  number of stim classes
+		32  ...     varint trial count of each stim class
+		    uint32  number of histograms, each:
+		            varint channel, varint unit, varint stim class,
+		            varint number of changed bins, each:
+		              varint bins skipped since the previous changed bin
+		              signed varint change in spike count
+
+	A keyframe holds every non-empty histogram, as changes from zero. A
+	subscriber applies deltas in sequence on top of the last keyframe; on
+	joining, or on a gap in the sequence numbers, it subscribes to "PSTH"
+	again, and the publisher answers every subscription with a keyframe.
+	A change of bin layout, and anything that renumbers or drops histograms
+	(fewer channels, units or stim classes, a reset, a rebin), is always sent
+	as a keyframe, so subscribers never keep histograms that are gone.
+*/
+class HistogramPublisher : public Thread
+{
+public:
+	HistogramPublisher(void* context);
+	~HistogramPublisher();
+
+	/** Binds to endpoint (e.g. tcp://127.0.0.1:5558), or stops publishing if it is empty */
+	void setEndpoint(const String& endpoint);
+
+	/** Engine thread, at TrialEnd: captures the changed blocks and has them published.
+		Never blocks; does nothing unless a socket is bound */
+	void update(const PSTHTensor& tensor);
+
+	/** True once the publisher needs a capture before the next TrialEnd, e.g. for a
+		new subscriber; the engine then calls update() */
+	bool isUpdateWanted() const { return updateWanted.load(std::memory_order_relaxed); }
+
+	void run() override;
+
+	static const uint8 version = 1;
+	enum Kind { KEYFRAME = 1, DELTA = 2 };
+
+private:
+	void openSocket();
+	void closeSocket();
+
+	/** Reads the subscriptions received; true if there was any (a keyframe request) */
+	bool takeSubscriptions();
+
+	/** Takes the newest capture, if the engine filled one since; true if it did */
+	bool takeCapture();
+
+	/** Sends the histograms of the current capture that changed, or all of them */
+	void publish(bool keyframe);
+
+	void* context;
+	void* socket = nullptr;
+
+	CriticalSection endpointLock; // guards endpoint
+	String endpoint;
+	std::atomic<bool> endpointChanged{ false };
+	std::atomic<bool> active{ false }; // a socket is bound
+	std::atomic<bool> updateWanted{ false };
+
+	/* triple buffer: the engine fills captures[back], swaps it with the one in
+	   mailbox and flags it fresh; the publisher swaps a fresh one for captures[front] */
+	static const int fresh = 4;
+	PSTHTensor::Capture captures[3];
+	std::atomic<int> mailbox{ 1 };
+	int back = 0; // engine thread
+	int front = 2; // publisher thread
+
+	/* publisher thread only: the state subscribers have, by block of the capture */
+	uint64 sequence = 0;
+	uint64 publishedEpoch = 0;
+	PSTHBinning publishedBinning;
+	int publishedChannels = 0;
+	int publishedUnits = 0;
+	int publishedConditions = 0;
+	std::vector<uint32> publishedVersions;
+	std::vector<uint32> publishedCounts; // block * bins per histogram
+	std::vector<uint8> message;
+	std::vector<uint8> changes; // bin changes of one histogram, written after their number
+
+	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(HistogramPublisher);
+};
+
+#endif // HISTOGRAMPUBLISHER_H_DEFINED
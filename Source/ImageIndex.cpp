@@ -0,0 +1,113 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ImageIndex.h"
+
+#include <cstring>
+
+ImageIndex::ImageIndex()
+{
+	slots.resize(64);
+	mask = slots.size() - 1;
+}
+
+uint32 ImageIndex::hashKey(std::string_view key)
+{
+	/* FNV-1a */
+	uint32 hash = 2166136261u;
+	for (char c : key)
+	{
+		hash = (hash ^ uint8(c)) * 16777619u;
+	}
+	return hash;
+}
+
+size_t ImageIndex::probe(std::string_view key, uint32 hash) const
+{
+	size_t i = hash & mask;
+	while (slots[i].stimClass >= 0)
+	{
+		const Slot& slot = slots[i];
+		if (slot.hash == hash && slot.length == key.size()
+			&& std::memcmp(arena.data() + slot.offset, key.data(), key.size()) == 0)
+		{
+			break;
+		}
+		i = (i + 1) & mask;
+	}
+	return i;
+}
+
+void ImageIndex::add(std::string_view image_id, int stim_class)
+{
+	if (stim_class < 0)
+	{
+		return;
+	}
+	if (size_t(count + 1) * 2 > slots.size())
+	{
+		grow();
+	}
+	uint32 hash = hashKey(image_id);
+	Slot& slot = slots[probe(image_id, hash)];
+	if (slot.stimClass < 0)
+	{
+		slot.hash = hash;
+		slot.length = uint32(image_id.size());
+		slot.offset = arena.size();
+		arena.insert(arena.end(), image_id.begin(), image_id.end());
+		count++;
+	}
+	slot.stimClass = stim_class;
+}
+
+int ImageIndex::find(std::string_view image_id) const
+{
+	return slots[probe(image_id, hashKey(image_id))].stimClass;
+}
+
+void ImageIndex::clear()
+{
+	std::fill(slots.begin(), slots.end(), Slot());
+	arena.clear();
+	count = 0;
+}
+
+void ImageIndex::grow()
+{
+	std::vector<Slot> old(slots.size() * 2);
+	old.swap(slots);
+	mask = slots.size() - 1;
+	for (const Slot& slot : old)
+	{
+		if (slot.stimClass >= 0)
+		{
+			size_t i = slot.hash & mask;
+			while (slots[i].stimClass >= 0)
+			{
+				i = (i + 1) & mask;
+			}
+			slots[i] = slot;
+		}
+	}
+}
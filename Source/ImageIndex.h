@@ -0,0 +1,94 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef IMAGEINDEX_H_DEFINED
+#define IMAGEINDEX_H_DEFINED
+
+#include <ProcessorHeaders.h>
+
+#include <string_view>
+#include <vector>
+
+/**
+	Interned image id -> stim class lookup, filled at AddCondition time and
+	read on every TrialStart.
+
+	Open addressing with linear probing over a power-of-two slot array kept
+	at most half full. The keys are copied back to back into a single
+	character arena; a slot holds the key's hash, its place in the arena
+	and the stim class, so a lookup hashes the id once and usually compares
+	a single key.
+*/
+class ImageIndex
+{
+public:
+	ImageIndex();
+
+	/** Maps image_id to stim_class, replacing any previous mapping */
+	void add(std::string_view image_id, int stim_class);
+
+	/** Stim class of image_id, or -1 if it was never added */
+	int find(std::string_view image_id) const;
+
+	/** Calls callback(std::string_view image_id, int stim_class) for every image id */
+	template <typename Callback>
+	void forEach(Callback&& callback) const
+	{
+		for (const Slot& slot : slots)
+		{
+			if (slot.stimClass >= 0)
+			{
+				callback(std::string_view(arena.data() + slot.offset, slot.length), slot.stimClass);
+			}
+		}
+	}
+
+	/** Number of image ids */
+	int size() const { return count; }
+
+	/** Drops every image id, keeping the allocated storage */
+	void clear();
+
+private:
+	struct Slot
+	{
+		uint32 hash = 0;
+		uint32 length = 0;
+		size_t offset = 0; // into arena
+		int stimClass = -1; // -1: empty
+	};
+
+	static uint32 hashKey(std::string_view key);
+
+	/** Slot holding key, or the empty slot where it belongs */
+	size_t probe(std::string_view key, uint32 hash) const;
+
+	void grow();
+
+	std::vector<Slot> slots;
+	size_t mask = 0;
+	std::vector<char> arena;
+	int count = 0;
+};
+
+#endif // IMAGEINDEX_H_DEFINED
@@ -0,0 +1,99 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "KofikoMessage.h"
+
+namespace
+{
+	struct CommandWord
+	{
+		std::string_view word;
+		TrialEvent::Type type;
+	};
+
+	constexpr CommandWord commandWords[] = {
+		{ "ClearDesign", TrialEvent::CLEAR_DESIGN },
+		{ "AddCondition", TrialEvent::ADD_CONDITION },
+		{ "TrialStart", TrialEvent::TRIAL_START }, // Jialiang / Berkeley Kofiko -- Sept. 2022
+		{ "TrialType", TrialEvent::TRIAL_TYPE }, // Janis Kofiko -- deprecated
+		{ "TrialAlign", TrialEvent::TRIAL_ALIGN },
+		{ "TrialEnd", TrialEvent::TRIAL_END },
+		{ "SetDesign", TrialEvent::SET_DESIGN },
+	};
+}
+
+KofikoMessage::KofikoMessage(std::string_view text)
+	: rest(text)
+{
+	next(command);
+}
+
+bool KofikoMessage::getType(TrialEvent::Type& type) const
+{
+	for (const CommandWord& c : commandWords)
+	{
+		if (c.word == command)
+		{
+			type = c.type;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool KofikoMessage::next(std::string_view& token)
+{
+	size_t start = 0;
+	while (start < rest.size() && isSpace(rest[start]))
+	{
+		start++;
+	}
+	size_t end = start;
+	while (end < rest.size() && !isSpace(rest[end]))
+	{
+		end++;
+	}
+	token = rest.substr(start, end - start);
+	rest.remove_prefix(end);
+	return !token.empty();
+}
+
+void KofikoMessage::skip(int n)
+{
+	std::string_view token;
+	for (int i = 0; i < n && next(token); i++)
+	{
+	}
+}
+
+bool KofikoMessage::nextLine(std::string_view& text, std::string_view& line)
+{
+	if (text.empty())
+	{
+		return false;
+	}
+	size_t end = text.find('\n');
+	line = text.substr(0, end);
+	text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+	return true;
+}
@@ -0,0 +1,72 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef KOFIKOMESSAGE_H_DEFINED
+#define KOFIKOMESSAGE_H_DEFINED
+
+#include <ProcessorHeaders.h>
+
+#include "TrialEvent.h"
+
+#include <string_view>
+
+/**
+	Reads a Kofiko text message ("AddCondition Name A Visible 1 TrialTypes 12 13",
+	"TrialStart 12", ...) in place, without allocating.
+
+	The command word is looked up in a compile-time table that maps each
+	text command onto the matching binary TrialEvent type; the arguments
+	are then read one whitespace-separated token at a time.
+
+	SetDesign installs a whole design at once; it is followed by one
+	AddCondition line per condition:
+
+		SetDesign
+		AddCondition Name A Visible 1 TrialTypes 12 13
+		AddCondition Name B Visible 1 TrialTypes 14
+*/
+class KofikoMessage
+{
+public:
+	KofikoMessage(std::string_view text);
+
+	/** Type of the command word; false if the message is not a known command */
+	bool getType(TrialEvent::Type& type) const;
+
+	/** Reads the next argument; returns false when there are none left */
+	bool next(std::string_view& token);
+
+	/** Skips n arguments */
+	void skip(int n);
+
+	/** Splits the first line off text; returns false when text is empty */
+	static bool nextLine(std::string_view& text, std::string_view& line);
+
+private:
+	static bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+
+	std::string_view command;
+	std::string_view rest;
+};
+
+#endif // KOFIKOMESSAGE_H_DEFINED
@@ -0,0 +1,167 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "PSTHRebinner.h"
+
+#include <algorithm>
+
+PSTHRebinner::PSTHRebinner()
+{
+}
+
+PSTHRebinner::~PSTHRebinner()
+{
+	retire();
+	retired.clear(); // each job waits for its thread
+}
+
+void PSTHRebinner::start(TrialLog::Snapshot snapshot_, PSTHBinning base_, PSTHBinning binning_, int n_conditions, std::vector<int64> sample_rates)
+{
+	retire();
+	job = std::make_unique<Job>();
+	job->snapshot = std::move(snapshot_);
+	job->base = base_;
+	job->binning = binning_;
+	job->nConditions = n_conditions;
+	job->sampleRates = std::move(sample_rates);
+	job->result.setStoragePolicy(storage);
+	job->startThread();
+}
+
+void PSTHRebinner::cancel()
+{
+	retire();
+}
+
+void PSTHRebinner::finish()
+{
+	retire();
+}
+
+void PSTHRebinner::retire()
+{
+	if (job != nullptr)
+	{
+		job->signalThreadShouldExit();
+		retired.push_back(std::move(job));
+	}
+	collect();
+}
+
+void PSTHRebinner::collect()
+{
+	retired.erase(std::remove_if(retired.begin(), retired.end(),
+		[](const std::unique_ptr<Job>& stopping) { return !stopping->isThreadRunning(); }), retired.end());
+}
+
+PSTHRebinner::Job::Job()
+	: Thread("SyncSinkRebinThread")
+{
+}
+
+PSTHRebinner::Job::~Job()
+{
+	if (!stopThread(1000))
+	{
+		std::cout << "PSTHRebinner::Job::~Job(): rebin thread timeout" << std::endl;
+	}
+}
+
+void PSTHRebinner::accumulate(PSTHTensor& tensor, const TrialLog::Trial& trial, const std::vector<int64>& sample_rates)
+{
+	if (trial.stimClass < 0 || trial.stimClass >= tensor.getNumConditions())
+	{
+		return;
+	}
+	const PSTHBinning& binning = tensor.getBaseBinning();
+	/* a group's offsets are decoded in ascending order, so its bins are too;
+	   each group is binned in one batch when the next one starts */
+	static thread_local std::vector<int64> offsets;
+	static thread_local std::vector<int> bins;
+	int channel = -1;
+	int unit = -1;
+	int stream = -1;
+	int64 samplesPerSecond = 0; // -1 if the group's stream has no known sample rate
+	auto flush = [&]()
+	{
+		int count = 0;
+		const int* window = binning.getWindowBins(offsets, samplesPerSecond, bins, count);
+		if (count > 0)
+		{
+			tensor.ensure(channel, unit);
+			tensor.addSpikes(channel, unit, trial.stimClass, window, count);
+		}
+		offsets.clear();
+	};
+
+	PSTHTensor::WriteScope write(tensor);
+	offsets.clear();
+	TrialLog::decode(trial, [&](const TrialLog::Spike& spike)
+		{
+			if (spike.channelIdx != channel || spike.sortedId != unit || spike.streamId != stream)
+			{
+				flush();
+				channel = spike.channelIdx;
+				unit = spike.sortedId;
+				stream = spike.streamId;
+				samplesPerSecond = 0;
+				if (trial.sampleClock)
+				{
+					bool known = spike.streamId < sample_rates.size() && sample_rates[spike.streamId] > 0;
+					samplesPerSecond = known ? sample_rates[spike.streamId] : -1;
+				}
+			}
+			if (samplesPerSecond >= 0)
+			{
+				offsets.push_back(spike.offset);
+			}
+		});
+	flush();
+	tensor.addTrial(trial.stimClass);
+}
+
+void PSTHRebinner::Job::run()
+{
+	try
+	{
+		result.setBinning(base);
+		result.setDisplayBinning(binning);
+		result.setNumConditions(nConditions);
+		for (const TrialLog::Trial& trial : snapshot.trials)
+		{
+			if (threadShouldExit())
+			{
+				return;
+			}
+			accumulate(result, trial, sampleRates);
+		}
+	}
+	catch (const std::bad_alloc&)
+	{
+		/* never done: the live tensor keeps its layout until the next rebin */
+		std::cout << "PSTHRebinner::Job::run(): out of memory; rebin to " << binning.nBins << " x "
+			<< binning.binSize << " ms abandoned" << std::endl;
+		return;
+	}
+	done.store(true, std::memory_order_release);
+}
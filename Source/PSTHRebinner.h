@@ -0,0 +1,109 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef PSTHREBINNER_H_DEFINED
+#define PSTHREBINNER_H_DEFINED
+
+#include <ProcessorHeaders.h>
+
+#include "PSTHTensor.h"
+#include "TrialLog.h"
+
+/**
+	Rebuilds a spike tensor for a new bin layout from a TrialLog snapshot
+	on a background thread.
+
+	The engine starts a job with start(), keeps binning new trials into the
+	live tensor with the old layout, and polls isDone(). It then adopts the
+	result and replays the trials logged after the snapshot with accumulate().
+
+	Each job runs on a thread of its own. cancel() and start() only signal a
+	running job to exit and set it aside, so the engine never waits for one;
+	collect() frees the jobs whose threads have exited.
+*/
+class PSTHRebinner
+{
+public:
+	PSTHRebinner();
+	~PSTHRebinner();
+
+	/** Cancels any running job and starts rebuilding at the base layout, displayed as binning */
+	void start(TrialLog::Snapshot snapshot, PSTHBinning base, PSTHBinning binning, int n_conditions, std::vector<int64> sample_rates);
+
+	/** Discards the running job, if any, without waiting for its thread */
+	void cancel();
+
+	/** Frees cancelled and finished jobs whose threads have exited; never blocks */
+	void collect();
+
+	/** True once a started job has finished; stays true until the next start() or cancel() */
+	bool isDone() const { return job != nullptr && job->done.load(std::memory_order_acquire); }
+
+	/** True between start() and collection of the result (cancel() or the next start()) */
+	bool isPending() const { return job != nullptr; }
+
+	/** The rebuilt tensor; only valid when isDone() */
+	PSTHTensor& getResult() { return job->result; }
+	const PSTHBinning& getBinning() const { return job->binning; }
+
+	/** Index past the last logged trial included in the result; later trials must be replayed */
+	int getNumTrials() const { return job->snapshot.firstTrial + (int)job->snapshot.trials.size(); }
+
+	/** Marks the result as collected */
+	void finish();
+
+	/** Storage of the rebuilt tensors; see PSTHTensor::setStoragePolicy() */
+	void setStoragePolicy(const TensorBuffer::Policy& policy) { storage = policy; }
+
+	/** Bins one logged trial into a tensor at its base layout */
+	static void accumulate(PSTHTensor& tensor, const TrialLog::Trial& trial, const std::vector<int64>& sample_rates);
+
+private:
+	class Job : public Thread
+	{
+	public:
+		Job();
+		~Job();
+
+		void run() override;
+
+		TrialLog::Snapshot snapshot;
+		PSTHBinning base;
+		PSTHBinning binning;
+		int nConditions = 0;
+		std::vector<int64> sampleRates; // by stream id
+		PSTHTensor result;
+		std::atomic<bool> done{ false };
+	};
+
+	/** Signals the current job, if any, to exit and sets it aside for collect() */
+	void retire();
+
+	std::unique_ptr<Job> job;
+	std::vector<std::unique_ptr<Job>> retired; // threads still exiting
+	TensorBuffer::Policy storage;
+
+	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(PSTHRebinner);
+};
+
+#endif // PSTHREBINNER_H_DEFINED
@@ -0,0 +1,778 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "PSTHTensor.h"
+
+#include <algorithm>
+#include <thread>
+
+/* Smallest power-of-two multiple of the current capacity (at least 4) that holds n */
+static int growCapacity(int capacity, int n)
+{
+	int c = capacity < 4 ? 4 : capacity;
+	while (c < n)
+	{
+		c *= 2;
+	}
+	return c;
+}
+
+/* Rounds towards negative infinity, so spikes just before TrialAlign land in bin -1 rather than 0 */
+static int64 floorDiv(int64 a, int64 b)
+{
+	int64 q = a / b;
+	return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+int PSTHBinning::getBin(int64 offset, int64 samples_per_second) const
+{
+	if (binSize <= 0)
+	{
+		return -1;
+	}
+	if (samples_per_second > 0)
+	{
+		/* bin = samples / (binSize ms * sampleRate / 1000), in integers */
+		return (int)floorDiv(offset * 1000, int64(binSize) * samples_per_second) + preBins;
+	}
+	return (int)floorDiv(offset, binSize) + preBins;
+}
+
+const int* PSTHBinning::getWindowBins(const std::vector<int64>& offsets, int64 samples_per_second, std::vector<int>& bins, int& count) const
+{
+	/* the bins are monotonic in the offsets, so the window is one contiguous run */
+	bins.resize(offsets.size());
+	for (size_t i = 0; i < offsets.size(); i++)
+	{
+		bins[i] = getBin(offsets[i], samples_per_second);
+	}
+	auto first = std::lower_bound(bins.begin(), bins.end(), 0);
+	auto last = std::lower_bound(first, bins.end(), getRowLength());
+	count = int(last - first);
+	return bins.data() + (first - bins.begin());
+}
+
+PSTHTensor::PSTHTensor()
+{
+	base.nBins = 0;
+	display.nBins = 0;
+	unitSlots.resize(16);
+	publish();
+}
+
+PSTHTensor::ReadScope::ReadScope(const PSTHTensor& t) : tensor(t)
+{
+	/* announce the reader before looking at any buffer (pairs with the fence in reclaim()) */
+	tensor.activeReaders.fetch_add(1);
+	while ((sequence = tensor.sequence.load(std::memory_order_acquire)) & 1)
+	{
+		std::this_thread::yield();
+	}
+}
+
+PSTHTensor::ReadScope::~ReadScope()
+{
+	tensor.activeReaders.fetch_sub(1, std::memory_order_release);
+}
+
+bool PSTHTensor::ReadScope::retry()
+{
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (tensor.sequence.load(std::memory_order_relaxed) == sequence)
+	{
+		return false;
+	}
+	while ((sequence = tensor.sequence.load(std::memory_order_acquire)) & 1)
+	{
+		std::this_thread::yield();
+	}
+	return true;
+}
+
+void PSTHTensor::beginWrite()
+{
+	if (writeDepth++ == 0)
+	{
+		writeVersion = ++lastVersion;
+		sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+}
+
+void PSTHTensor::endWrite()
+{
+	if (--writeDepth == 0)
+	{
+		publish();
+		sequence.store(sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		reclaim();
+	}
+}
+
+void PSTHTensor::publish()
+{
+	auto next = std::make_unique<Layout>();
+	next->nChannels = nChannels;
+	next->nUnits = nUnits;
+	next->nConditions = nConditions;
+	next->unitSlots = unitSlots.data();
+	next->unitMask = unitSlots.size() - 1;
+	next->pages = pages.data();
+	next->pageCapacity = pageCapacity;
+	next->conditionCapacity = size_t(conditionCapacity);
+	next->data = data.data();
+	next->squares = squares.data();
+	next->blockVersions = blockVersions.data();
+	next->blockCapacity = blockCapacity;
+	next->rowStride = rowStride;
+	next->squareStride = squareStride;
+	next->trialCounts = trialCounts.data();
+	next->conditionVersions = conditionVersions.data();
+	next->display = display;
+	next->binFactor = binFactor;
+	next->binOffset = binOffset;
+	next->momentsValid = momentsValid;
+
+	const Layout* last = layout.get();
+	if (last != nullptr && last->nChannels == next->nChannels && last->nUnits == next->nUnits
+		&& last->nConditions == next->nConditions && last->unitSlots == next->unitSlots
+		&& last->unitMask == next->unitMask && last->pages == next->pages
+		&& last->pageCapacity == next->pageCapacity && last->conditionCapacity == next->conditionCapacity
+		&& last->data == next->data && last->squares == next->squares
+		&& last->blockVersions == next->blockVersions && last->blockCapacity == next->blockCapacity && last->rowStride == next->rowStride
+		&& last->squareStride == next->squareStride && last->trialCounts == next->trialCounts
+		&& last->conditionVersions == next->conditionVersions && last->display.nBins == next->display.nBins
+		&& last->display.binSize == next->display.binSize && last->display.preBins == next->display.preBins
+		&& last->binFactor == next->binFactor && last->binOffset == next->binOffset
+		&& last->momentsValid == next->momentsValid)
+	{
+		return; // most writes only add counts
+	}
+	publishedLayout.store(next.get(), std::memory_order_release);
+	if (layout != nullptr)
+	{
+		retiredLayouts.push_back(std::move(layout));
+	}
+	layout = std::move(next);
+}
+
+void PSTHTensor::reclaim()
+{
+	if (retired.empty() && retiredUnitSlots.empty() && retiredTrialCounts.empty() && retiredBuffers.empty()
+		&& retiredLayouts.empty())
+	{
+		return;
+	}
+	/* a reader that registers after this fence sees the new buffers */
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (activeReaders.load() == 0)
+	{
+		retired.clear();
+		retiredUnitSlots.clear();
+		retiredTrialCounts.clear();
+		retiredBuffers.clear();
+		retiredLayouts.clear();
+	}
+}
+
+void PSTHTensor::ensure(int channel_idx, int sorted_id)
+{
+	if (channel_idx >= nChannels || sorted_id >= nUnits)
+	{
+		WriteScope write(*this);
+		nChannels = jmax(nChannels, channel_idx + 1);
+		nUnits = jmax(nUnits, sorted_id + 1);
+	}
+}
+
+void PSTHTensor::setNumConditions(int n_conditions)
+{
+	WriteScope write(*this);
+	if (n_conditions > conditionCapacity)
+	{
+		relayout(growCapacity(conditionCapacity, n_conditions), nBins);
+	}
+	else if (n_conditions < nConditions)
+	{
+		/* rows beyond the new extent must read as zero if the conditions are added
+		   again; their blocks are orphaned until the next re-layout compacts the slab */
+		for (size_t page = 0; page < nPages; page++)
+		{
+			uint32* entries = pages.data() + page * conditionCapacity;
+			for (int cond = n_conditions; cond < nConditions; cond++)
+			{
+				if (entries[cond] != 0)
+				{
+					blockRows[(entries[cond] - 1) * 3] = -1;
+					entries[cond] = 0;
+				}
+			}
+		}
+		layoutEpoch++;
+	}
+	for (int cond = nConditions; cond < n_conditions; cond++)
+	{
+		trialCounts[cond] = 0;
+		conditionVersions[cond] = writeVersion;
+	}
+	nConditions = n_conditions;
+}
+
+void PSTHTensor::setBinning(const PSTHBinning& base_)
+{
+	WriteScope write(*this);
+	/* the buffers are allocated before the binning changes, so if one cannot
+	   be (std::bad_alloc) the tensor is left as it was */
+	TensorBuffer newSquares(blockCapacity * size_t(base_.getRowLength()), storage);
+	if (base_.getRowLength() != nBins)
+	{
+		relayout(conditionCapacity, base_.getRowLength());
+	}
+	base = base_;
+	display = base_;
+	binFactor = 1;
+	binOffset = 0;
+	resetMoments(std::move(newSquares));
+	std::fill(conditionVersions.begin(), conditionVersions.end(), writeVersion);
+}
+
+bool PSTHTensor::canDisplay(const PSTHBinning& base, const PSTHBinning& display)
+{
+	if (base.binSize <= 0 || display.binSize <= 0 || display.binSize % base.binSize != 0)
+	{
+		return false;
+	}
+	int64 factor = display.binSize / base.binSize;
+	return display.preBins * factor <= base.preBins && display.nBins * factor <= base.nBins;
+}
+
+bool PSTHTensor::setDisplayBinning(const PSTHBinning& display_)
+{
+	if (!canDisplay(base, display_))
+	{
+		return false;
+	}
+	WriteScope write(*this);
+	bool sameLayout = display.binSize == display_.binSize && display.nBins == display_.nBins && display.preBins == display_.preBins;
+	TensorBuffer newSquares(sameLayout ? 0 : blockCapacity * size_t(display_.getRowLength()), storage);
+	display = display_;
+	binFactor = display.binSize / base.binSize;
+	binOffset = base.preBins - display.preBins * binFactor;
+	if (!sameLayout)
+	{
+		resetMoments(std::move(newSquares));
+	}
+	std::fill(conditionVersions.begin(), conditionVersions.end(), writeVersion);
+	return true;
+}
+
+bool PSTHTensor::contains(int channel_idx, int sorted_id, int stim_class) const
+{
+	return channel_idx >= 0 && channel_idx < nChannels
+		&& sorted_id >= 0 && sorted_id < nUnits
+		&& stim_class >= 0 && stim_class < nConditions;
+}
+
+void PSTHTensor::addSpikes(int channel_idx, int sorted_id, int stim_class, const int* bins, int n_spikes)
+{
+	if (n_spikes == 0)
+	{
+		return;
+	}
+	uint32 entry = findRow(channel_idx, sorted_id, stim_class);
+	size_t block = entry != 0 ? entry - 1 : allocateBlock(channel_idx, sorted_id, stim_class);
+	uint32* sums = data.data() + block * rowStride;
+	/* sums[i + 1] gains the spikes in bins <= i: k + 1 of them from the bin of
+	   spike k up to that of spike k + 1, so each run is a plain vector add */
+	for (int k = 0; k < n_spikes; k++)
+	{
+		int end = k + 1 < n_spikes ? bins[k + 1] : nBins;
+		uint32 added = uint32(k + 1);
+		for (int i = bins[k]; i < end; i++)
+		{
+			sums[i + 1] += added;
+		}
+	}
+
+	/* squared counts of the displayed bins this trial has spikes in */
+	uint32* squared = squares.data() + block * squareStride;
+	int displayBins = int(squareStride);
+	int i = 0;
+	while (i < n_spikes && bins[i] < binOffset)
+	{
+		i++;
+	}
+	while (i < n_spikes)
+	{
+		int bin = (bins[i] - binOffset) / binFactor;
+		if (bin >= displayBins)
+		{
+			break;
+		}
+		int end = binOffset + (bin + 1) * binFactor;
+		uint32 count = 0;
+		while (i < n_spikes && bins[i] < end)
+		{
+			count++;
+			i++;
+		}
+		squared[bin] += count * count;
+	}
+	blockVersions[block] = writeVersion;
+}
+
+void PSTHTensor::reserveRow(int channel_idx, int sorted_id, int stim_class)
+{
+	if (findRow(channel_idx, sorted_id, stim_class) == 0)
+	{
+		WriteScope write(*this);
+		allocateBlock(channel_idx, sorted_id, stim_class);
+	}
+}
+
+PSTHTensor::HistogramView PSTHTensor::getView(int channel_idx, int sorted_id, int stim_class) const
+{
+	/* a Layout is consistent with the buffers it points to, so indices checked
+	   against it stay inside them whatever the writer has done since */
+	const Layout& l = *publishedLayout.load(std::memory_order_seq_cst);
+	HistogramView view;
+	view.nBins = l.display.getRowLength();
+	view.preBins = l.display.preBins;
+	view.binSize = l.display.binSize;
+	view.binFactor = l.binFactor;
+	view.binOffset = l.binOffset;
+	view.hasMoments = l.momentsValid;
+	if (stim_class < 0 || stim_class >= l.nConditions)
+	{
+		return view;
+	}
+	view.nTrials = l.trialCounts[stim_class];
+	view.version = l.conditionVersions[stim_class];
+	if (channel_idx < 0 || channel_idx >= l.nChannels || sorted_id < 0 || sorted_id >= l.nUnits)
+	{
+		return view;
+	}
+	/* the unit table and the pages are filled in place, so a slot may be half
+	   written and an entry may already name a page or block of newer buffers */
+	size_t i = hashUnit(channel_idx, sorted_id) & l.unitMask;
+	for (size_t probes = 0; probes <= l.unitMask && l.unitSlots[i].channel >= 0; probes++, i = (i + 1) & l.unitMask)
+	{
+		const UnitSlot& slot = l.unitSlots[i];
+		if (slot.channel != channel_idx || slot.unit != sorted_id)
+		{
+			continue;
+		}
+		uint32 entry = slot.page < l.pageCapacity ? l.pages[slot.page * l.conditionCapacity + stim_class] : 0;
+		if (entry != 0 && entry <= l.blockCapacity)
+		{
+			size_t block = entry - 1;
+			view.cumulative = l.data + block * l.rowStride;
+			view.squares = l.squares + block * l.squareStride;
+			view.version = jmax(view.version, l.blockVersions[block]);
+		}
+		break;
+	}
+	return view;
+}
+
+void PSTHTensor::addTrial(int stim_class)
+{
+	if (stim_class >= 0 && stim_class < nConditions)
+	{
+		WriteScope write(*this);
+		trialCounts[stim_class]++;
+		conditionVersions[stim_class] = writeVersion;
+	}
+}
+
+int PSTHTensor::getNumTrials(int stim_class) const
+{
+	if (stim_class < 0 || stim_class >= nConditions)
+	{
+		return 0;
+	}
+	return trialCounts[stim_class];
+}
+
+void PSTHTensor::zero()
+{
+	WriteScope write(*this);
+	retiredBuffers.push_back(std::move(data));
+	retiredBuffers.push_back(std::move(squares));
+	retired.push_back(std::move(blockVersions));
+	data = TensorBuffer();
+	squares = TensorBuffer();
+	blockVersions.clear();
+	std::fill(pages.begin(), pages.end(), 0u);
+	blockRows.clear();
+	nBlocks = blockCapacity = 0;
+	layoutEpoch++;
+	momentsValid = true;
+	std::fill(trialCounts.begin(), trialCounts.end(), 0);
+	std::fill(conditionVersions.begin(), conditionVersions.end(), writeVersion);
+}
+
+void PSTHTensor::clear()
+{
+	WriteScope write(*this);
+	retiredBuffers.push_back(std::move(data));
+	retiredBuffers.push_back(std::move(squares));
+	retired.push_back(std::move(pages));
+	retired.push_back(std::move(blockVersions));
+	retired.push_back(std::move(conditionVersions));
+	retiredUnitSlots.push_back(std::move(unitSlots));
+	retiredTrialCounts.push_back(std::move(trialCounts));
+	data = TensorBuffer();
+	squares = TensorBuffer();
+	unitSlots.assign(16, UnitSlot());
+	pages.clear();
+	pageUnits.clear();
+	nPages = pageCapacity = 0;
+	blockVersions.clear();
+	conditionVersions.clear();
+	trialCounts.clear();
+	nChannels = nUnits = nConditions = 0;
+	conditionCapacity = 0;
+	blockRows.clear();
+	nBlocks = blockCapacity = 0;
+	layoutEpoch++;
+	momentsValid = true;
+}
+
+void PSTHTensor::adopt(PSTHTensor& other)
+{
+	WriteScope write(*this);
+	retiredBuffers.push_back(std::move(data));
+	retiredBuffers.push_back(std::move(squares));
+	retired.push_back(std::move(pages));
+	retired.push_back(std::move(blockVersions));
+	retired.push_back(std::move(conditionVersions));
+	retiredUnitSlots.push_back(std::move(unitSlots));
+	retiredTrialCounts.push_back(std::move(trialCounts));
+	data = std::move(other.data);
+	squares = std::move(other.squares);
+	unitSlots = std::move(other.unitSlots);
+	pages = std::move(other.pages);
+	pageUnits = std::move(other.pageUnits);
+	nPages = other.nPages;
+	pageCapacity = other.pageCapacity;
+	blockVersions = std::move(other.blockVersions);
+	conditionVersions = std::move(other.conditionVersions);
+	trialCounts = std::move(other.trialCounts);
+
+	nChannels = other.nChannels;
+	nUnits = other.nUnits;
+	nConditions = other.nConditions;
+	nBins = other.nBins;
+	rowStride = other.rowStride;
+	base = other.base;
+	display = other.display;
+	binFactor = other.binFactor;
+	binOffset = other.binOffset;
+	squareStride = other.squareStride;
+	momentsValid = other.momentsValid;
+	conditionCapacity = other.conditionCapacity;
+	nBlocks = other.nBlocks;
+	blockCapacity = other.blockCapacity;
+	blockRows = std::move(other.blockRows);
+	layoutEpoch++;
+
+	/* every row changed as far as readers are concerned; other's versions
+	   come from its own counter, so none of them are kept */
+	std::fill(blockVersions.begin(), blockVersions.end(), writeVersion);
+	std::fill(conditionVersions.begin(), conditionVersions.end(), writeVersion);
+
+	other.clear();
+}
+
+void PSTHTensor::capture(Capture& capture) const
+{
+	/* blocks keep their number until the epoch changes, and a block only changes
+	   when its row is written, which stamps the row's version */
+	size_t kept = capture.epoch == layoutEpoch ? capture.getNumBlocks() : 0;
+	capture.blockRows.resize(nBlocks * 3);
+	capture.blockVersions.resize(nBlocks);
+	capture.sums.resize(nBlocks * rowStride);
+	capture.squares.resize(nBlocks * squareStride);
+	for (size_t block = 0; block < nBlocks; block++)
+	{
+		const int32* row = blockRows.data() + 3 * block;
+		if (block < kept && (row[0] < 0 || blockVersions[block] <= capture.version))
+		{
+			continue;
+		}
+		std::copy_n(row, 3, capture.blockRows.begin() + 3 * block);
+		if (row[0] < 0)
+		{
+			continue;
+		}
+		capture.blockVersions[block] = blockVersions[block];
+		std::copy_n(data.begin() + block * rowStride, rowStride, capture.sums.begin() + block * rowStride);
+		std::copy_n(squares.begin() + block * squareStride, squareStride, capture.squares.begin() + block * squareStride);
+	}
+	capture.epoch = layoutEpoch;
+	capture.version = lastVersion;
+	capture.base = base;
+	capture.display = display;
+	capture.nChannels = nChannels;
+	capture.nUnits = nUnits;
+	capture.nConditions = nConditions;
+	capture.hasMoments = momentsValid;
+	capture.rowStride = rowStride;
+	capture.squareStride = squareStride;
+	capture.binFactor = binFactor;
+	capture.binOffset = binOffset;
+	capture.trialCounts.assign(trialCounts.begin(), trialCounts.begin() + nConditions);
+}
+
+void PSTHTensor::restore(const PSTHBinning& base_, const PSTHBinning& display_, int n_channels, int n_units, int n_conditions,
+	size_t n_blocks, const int32* block_rows, const uint32* sums, const uint32* squares_, const int* trial_counts)
+{
+	WriteScope write(*this);
+	clear();
+	setBinning(base_);
+	if (!setDisplayBinning(display_))
+	{
+		squares_ = nullptr;
+	}
+	setNumConditions(n_conditions);
+	if (n_channels > 0 && n_units > 0)
+	{
+		ensure(n_channels - 1, n_units - 1);
+	}
+	/* the blocks become the slab as they are: one copy for the counts and one for the squares */
+	TensorBuffer newData(n_blocks * rowStride, storage);
+	TensorBuffer newSquares(n_blocks * squareStride, storage);
+	std::copy_n(sums, n_blocks * rowStride, newData.begin());
+	if (squares_ != nullptr)
+	{
+		std::copy_n(squares_, n_blocks * squareStride, newSquares.begin());
+	}
+	retiredBuffers.push_back(std::move(data));
+	retiredBuffers.push_back(std::move(squares));
+	retired.push_back(std::move(blockVersions));
+	data.swap(newData);
+	squares.swap(newSquares);
+	blockVersions.assign(n_blocks, writeVersion);
+	nBlocks = blockCapacity = n_blocks;
+	blockRows.assign(block_rows, block_rows + 3 * n_blocks);
+	for (size_t block = 0; block < n_blocks; block++)
+	{
+		int32* row = blockRows.data() + 3 * block;
+		if (contains(row[0], row[1], row[2]))
+		{
+			/* of two blocks for one row the later one wins; the earlier is orphaned */
+			uint32& rowBlock = rowEntry(row[0], row[1], row[2]);
+			if (rowBlock != 0)
+			{
+				blockRows[(rowBlock - 1) * 3] = -1;
+			}
+			rowBlock = uint32(block + 1);
+		}
+		else
+		{
+			row[0] = -1;
+		}
+	}
+	layoutEpoch++;
+	std::copy_n(trial_counts, n_conditions, trialCounts.begin());
+	momentsValid = squares_ != nullptr
+		|| std::all_of(trialCounts.begin(), trialCounts.begin() + nConditions, [](int n) { return n == 0; });
+	std::fill(conditionVersions.begin(), conditionVersions.end(), writeVersion);
+}
+
+void PSTHTensor::relayout(int condition_capacity, int n_bins)
+{
+	size_t newRowStride = size_t(n_bins) + 1;
+	std::vector<uint32> newPages(pageCapacity * size_t(condition_capacity), 0);
+	std::vector<uint32> newBlockVersions(blockCapacity, 0);
+	TensorBuffer newData(blockCapacity * newRowStride, storage);
+	TensorBuffer newSquares(blockCapacity * squareStride, storage);
+	std::vector<int32> newBlockRows;
+	newBlockRows.reserve(nBlocks * 3);
+	size_t newBlocks = 0;
+
+	/* blocks are renumbered in page order, dropping those orphaned by
+	   setNumConditions(). Prefix sums: keep the first min(old, new) bins and
+	   repeat the total over any new ones, so they read as empty */
+	int keepBins = jmin(nBins, n_bins);
+	for (size_t page = 0; page < nPages; page++)
+	{
+		for (int cond = 0; cond < nConditions; cond++)
+		{
+			uint32 entry = pages[page * conditionCapacity + cond];
+			if (entry == 0)
+			{
+				continue;
+			}
+			size_t block = entry - 1;
+			auto from = data.begin() + block * rowStride;
+			auto to = newData.begin() + newBlocks * newRowStride;
+			std::copy(from, from + keepBins + 1, to);
+			std::fill(to + keepBins + 1, to + newRowStride, from[keepBins]);
+			std::copy_n(squares.begin() + block * squareStride, squareStride, newSquares.begin() + newBlocks * squareStride);
+			newBlockVersions[newBlocks] = n_bins == nBins ? blockVersions[block] : writeVersion;
+			newBlockRows.insert(newBlockRows.end(), { pageUnits[2 * page], pageUnits[2 * page + 1], cond });
+			newPages[page * condition_capacity + cond] = uint32(++newBlocks);
+		}
+	}
+
+	if (condition_capacity != conditionCapacity)
+	{
+		std::vector<int> newTrialCounts(condition_capacity, 0);
+		std::vector<uint32> newConditionVersions(condition_capacity, 0);
+		std::copy(trialCounts.begin(), trialCounts.begin() + nConditions, newTrialCounts.begin());
+		std::copy(conditionVersions.begin(), conditionVersions.begin() + nConditions, newConditionVersions.begin());
+		retiredTrialCounts.push_back(std::move(trialCounts));
+		retired.push_back(std::move(conditionVersions));
+		trialCounts.swap(newTrialCounts);
+		conditionVersions.swap(newConditionVersions);
+	}
+
+	retiredBuffers.push_back(std::move(data));
+	retiredBuffers.push_back(std::move(squares));
+	retired.push_back(std::move(pages));
+	retired.push_back(std::move(blockVersions));
+	data.swap(newData);
+	squares.swap(newSquares);
+	pages.swap(newPages);
+	blockVersions.swap(newBlockVersions);
+	conditionCapacity = condition_capacity;
+	nBins = n_bins;
+	rowStride = newRowStride;
+	nBlocks = newBlocks;
+	blockRows.swap(newBlockRows);
+	layoutEpoch++;
+}
+
+size_t PSTHTensor::allocateBlock(int channel_idx, int sorted_id, int stim_class)
+{
+	if (nBlocks == blockCapacity)
+	{
+		/* grow the slab geometrically; readers may still hold the old one */
+		size_t capacity = blockCapacity < 16 ? 16 : blockCapacity * 2;
+		TensorBuffer newData(capacity * rowStride, storage);
+		TensorBuffer newSquares(capacity * squareStride, storage);
+		std::vector<uint32> newBlockVersions(capacity, 0);
+		std::copy_n(data.begin(), nBlocks * rowStride, newData.begin());
+		std::copy_n(squares.begin(), nBlocks * squareStride, newSquares.begin());
+		std::copy_n(blockVersions.begin(), nBlocks, newBlockVersions.begin());
+		retiredBuffers.push_back(std::move(data));
+		retiredBuffers.push_back(std::move(squares));
+		retired.push_back(std::move(blockVersions));
+		data.swap(newData);
+		squares.swap(newSquares);
+		blockVersions.swap(newBlockVersions);
+		blockCapacity = capacity;
+	}
+	rowEntry(channel_idx, sorted_id, stim_class) = uint32(nBlocks + 1);
+	blockVersions[nBlocks] = writeVersion;
+	blockRows.insert(blockRows.end(), { channel_idx, sorted_id, stim_class });
+	return nBlocks++;
+}
+
+uint32 PSTHTensor::hashUnit(int channel_idx, int sorted_id)
+{
+	uint32 hash = uint32(channel_idx) * 0x9E3779B1u ^ uint32(sorted_id) * 0x85EBCA77u;
+	return hash ^ (hash >> 16);
+}
+
+int64 PSTHTensor::findPage(int channel_idx, int sorted_id) const
+{
+	size_t mask = unitSlots.size() - 1;
+	for (size_t i = hashUnit(channel_idx, sorted_id) & mask; unitSlots[i].channel >= 0; i = (i + 1) & mask)
+	{
+		if (unitSlots[i].channel == channel_idx && unitSlots[i].unit == sorted_id)
+		{
+			return unitSlots[i].page;
+		}
+	}
+	return -1;
+}
+
+uint32 PSTHTensor::findRow(int channel_idx, int sorted_id, int stim_class) const
+{
+	int64 page = findPage(channel_idx, sorted_id);
+	return page >= 0 ? pages[size_t(page) * conditionCapacity + stim_class] : 0;
+}
+
+uint32& PSTHTensor::rowEntry(int channel_idx, int sorted_id, int stim_class)
+{
+	int64 page = findPage(channel_idx, sorted_id);
+	size_t p = page >= 0 ? size_t(page) : addPage(channel_idx, sorted_id);
+	return pages[p * conditionCapacity + stim_class];
+}
+
+size_t PSTHTensor::addPage(int channel_idx, int sorted_id)
+{
+	/* both tables grow into new buffers; readers may still hold the old ones */
+	if ((nPages + 1) * 2 > unitSlots.size())
+	{
+		std::vector<UnitSlot> newSlots(unitSlots.size() * 2);
+		size_t mask = newSlots.size() - 1;
+		for (const UnitSlot& slot : unitSlots)
+		{
+			if (slot.channel >= 0)
+			{
+				size_t i = hashUnit(slot.channel, slot.unit) & mask;
+				while (newSlots[i].channel >= 0)
+				{
+					i = (i + 1) & mask;
+				}
+				newSlots[i] = slot;
+			}
+		}
+		retiredUnitSlots.push_back(std::move(unitSlots));
+		unitSlots.swap(newSlots);
+	}
+	if (nPages == pageCapacity)
+	{
+		size_t capacity = pageCapacity < 16 ? 16 : pageCapacity * 2;
+		std::vector<uint32> newPages(capacity * conditionCapacity, 0);
+		std::copy_n(pages.begin(), nPages * conditionCapacity, newPages.begin());
+		retired.push_back(std::move(pages));
+		pages.swap(newPages);
+		pageCapacity = capacity;
+	}
+	size_t mask = unitSlots.size() - 1;
+	size_t i = hashUnit(channel_idx, sorted_id) & mask;
+	while (unitSlots[i].channel >= 0)
+	{
+		i = (i + 1) & mask;
+	}
+	unitSlots[i].unit = sorted_id;
+	unitSlots[i].page = uint32(nPages);
+	unitSlots[i].channel = channel_idx;
+	pageUnits.insert(pageUnits.end(), { channel_idx, sorted_id });
+	return nPages++;
+}
+
+void PSTHTensor::resetMoments(TensorBuffer new_squares)
+{
+	retiredBuffers.push_back(std::move(squares));
+	squares.swap(new_squares);
+	squareStride = size_t(display.getRowLength());
+	layoutEpoch++;
+	/* with no trials recorded the (empty) squares are exact */
+	momentsValid = std::all_of(trialCounts.begin(), trialCounts.begin() + nConditions, [](int n) { return n == 0; });
+}
@@ -0,0 +1,449 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef PSTHTENSOR_H_DEFINED
+#define PSTHTENSOR_H_DEFINED
+
+#include <ProcessorHeaders.h>
+
+#include "TensorBuffer.h"
+
+#include <atomic>
+#include <memory>
+#include <cmath>
+#include <vector>
+
+/**
+	Bin layout of a PSTH row: preBins bins before TrialAlign followed by
+	nBins bins after it, each binSize ms wide.
+*/
+struct PSTHBinning
+{
+	int nBins = 50; // default num bins
+	int binSize = 10; // default bin size (ms)
+	int preBins = 0;
+
+	/** Length of a tensor row */
+	int getRowLength() const { return preBins + nBins; }
+
+	/** Row index of a spike offset from TrialAlign, in ms or (when samples_per_second > 0)
+		in samples. The result is out of [0, getRowLength()) for spikes outside the window */
+	int getBin(int64 offset, int64 samples_per_second) const;
+
+	/** Bins a group of offsets in ascending order in one pass and returns the
+		in-window bins (ascending too) as [result, result + count), inside bins */
+	const int* getWindowBins(const std::vector<int64>& offsets, int64 samples_per_second, std::vector<int>& bins, int& count) const;
+};
+
+/**
+	Block-sparse n_channels * n_units * n_stim_classes * n_bins tensor of spike
+	counts, plus the number of trials recorded for each stim class.
+
+	Most (channel, unit, stim class) rows of a large design never see a spike,
+	so a row's bins are only allocated on its first spike: a block of one row
+	is taken from a slab shared by all rows. The index from rows to blocks
+	is two-level: an open-addressing table maps each (channel, unit) that has
+	spiked to a page of 4-byte entries, one per stim class, holding the
+	block. A unit costs nothing until its first spike, however large its
+	sorted id, and then one page. Rows without a block read as zeros.
+
+	Counts are kept as exact integers; rates are derived at read time from
+	the count, the trial count and the bin size.
+
+	Rows are accumulated at a fine base resolution and stored as prefix sums,
+	so the count of any run of base bins is a single subtraction. The
+	displayed layout can use any bin size that is a multiple of the base bin
+	size over a window that fits in the base window; switching to such a
+	layout is O(1) and reading a histogram is O(n_bins) whatever the bin size.
+
+	Alongside the counts, each row keeps the sum over trials of the squared
+	count of every displayed bin, so the trial-to-trial variance follows from
+	the two sums. Squares do not add up across bins, so these are kept in the
+	displayed layout: a trial only touches the bins it has spikes in, and a
+	display switch leaves them unavailable (hasMoments() false) until the
+	tensor is rebuilt from the trial log.
+
+	Growing the channel and unit extents is O(1). Pages are allocated with
+	spare stim classes that grow geometrically, so adding conditions only
+	re-lays out the pages O(log n) times; a row lookup is a hash probe and
+	an index load. The slab grows geometrically too, and re-layouts compact
+	it in page order. It lives in TensorBuffers, which go to a
+	memory-mapped file once the slab is projected past the storage policy's
+	threshold.
+
+	The tensor has a single writer (the engine thread) and any number of
+	readers on other threads. Writes are bracketed by a WriteScope, which
+	makes a sequence counter odd for their duration; readers take a
+	ReadScope, read rows in place through HistogramView, and retry if the
+	sequence changed underneath them. Readers find rows through a Layout the
+	writer publishes whole at the end of each write, and check every index
+	against it; buffers replaced by a re-layout, zero() or clear() are kept
+	until no reader is active, so a reader racing a write reads stale values
+	but never touches freed memory or reads past a buffer.
+*/
+class PSTHTensor
+{
+public:
+	PSTHTensor();
+
+	/** Zero-copy, read-only view of one histogram row in the displayed layout. Only valid inside a ReadScope */
+	struct HistogramView
+	{
+		const uint32* cumulative = nullptr; // spikes in base bins [0, i) at index i; nullptr if the row has no spikes
+		int nBins = 0;
+		int preBins = 0; // leading bins before TrialAlign; bin preBins starts at t = 0
+		int binSize = 0; // ms
+		int binFactor = 1; // base bins per bin
+		int binOffset = 0; // first base bin of bin 0
+		int nTrials = 0;
+		const uint32* squares = nullptr; // sum over trials of the squared count of each bin; nullptr if all zero or unknown
+		bool hasMoments = false; // false while the squares are being rebuilt for a new layout
+		uint32 version = 0; // changes whenever the counts, trial count or binning of this row change
+
+		/** Raw spike count of one bin */
+		uint32 getCount(int bin) const
+		{
+			if (cumulative == nullptr)
+			{
+				return 0;
+			}
+			int first = binOffset + bin * binFactor;
+			return cumulative[first + binFactor] - cumulative[first];
+		}
+
+		/** Mean firing rate in spikes/s for one bin */
+		double getRate(int bin) const
+		{
+			if (cumulative == nullptr || nTrials == 0 || binSize <= 0)
+			{
+				return 0;
+			}
+			return getCount(bin) * 1000.0 / (double(nTrials) * binSize);
+		}
+
+		/** Unbiased variance across trials of the spike count of one bin; 0 with fewer than two trials */
+		double getCountVariance(int bin) const
+		{
+			if (!hasMoments || nTrials < 2)
+			{
+				return 0;
+			}
+			double sum = getCount(bin);
+			double sumOfSquares = squares == nullptr ? 0 : squares[bin];
+			return jmax(0.0, (sumOfSquares - sum * sum / nTrials) / (nTrials - 1));
+		}
+
+		/** Standard error of the mean firing rate (spikes/s) for one bin */
+		double getRateSEM(int bin) const
+		{
+			if (nTrials == 0 || binSize <= 0)
+			{
+				return 0;
+			}
+			return std::sqrt(getCountVariance(bin) / nTrials) * 1000.0 / binSize;
+		}
+
+		/** Fano factor (count variance over mean count) of one bin; 0 if the bin is empty */
+		double getFanoFactor(int bin) const
+		{
+			if (nTrials == 0)
+			{
+				return 0;
+			}
+			double mean = double(getCount(bin)) / nTrials;
+			return mean > 0 ? getCountVariance(bin) / mean : 0;
+		}
+	};
+
+	/**
+		Brackets a reader's access to the tensor.
+
+		PSTHTensor::ReadScope read(tensor);
+		do
+		{
+			view = tensor.getView(...);
+			... use view ...
+		} while (read.retry());
+	*/
+	class ReadScope
+	{
+	public:
+		ReadScope(const PSTHTensor& t);
+		~ReadScope();
+
+		/** Returns true (and restarts the read) if a write happened since the read began */
+		bool retry();
+
+	private:
+		const PSTHTensor& tensor;
+		uint32 sequence;
+	};
+
+	/** Brackets a batch of writes; only used on the writer thread. Scopes may nest */
+	class WriteScope
+	{
+	public:
+		WriteScope(PSTHTensor& t) : tensor(t) { tensor.beginWrite(); }
+		~WriteScope() { tensor.endWrite(); }
+
+	private:
+		PSTHTensor& tensor;
+	};
+
+	/** Makes (channel_idx, sorted_id) addressable, growing the channel and unit extents if needed */
+	void ensure(int channel_idx, int sorted_id);
+
+	/** Sets the number of stim classes; existing rows are preserved */
+	void setNumConditions(int n_conditions);
+
+	/** Sets the base (storage) bin layout and displays it as is.
+		The first min(old, new) base bins of each row are preserved */
+	void setBinning(const PSTHBinning& base);
+
+	/** Shows the rows in a coarser layout without touching the counts. Returns
+		false, leaving the layout unchanged, unless canDisplay(getBaseBinning(), display) */
+	bool setDisplayBinning(const PSTHBinning& display);
+
+	/** True if every bin of display is a whole run of base bins */
+	static bool canDisplay(const PSTHBinning& base, const PSTHBinning& display);
+
+	/** Returns true if (channel_idx, sorted_id, stim_class) is within the extents; its
+		row may still have no block */
+	bool contains(int channel_idx, int sorted_id, int stim_class) const;
+
+	/** Adds one trial's spikes to a row, given their base bins in ascending order.
+		All of a trial's spikes for the row must come in one call, as they also
+		update the squared counts. The row must exist (see ensure()).
+		O(row length) however many spikes are added, in runs of constant adds
+		the compiler vectorizes.
+		Inside the writer's WriteScope, rows that have a block (see reserveRow())
+		may be filled from several threads at once, as long as each row has one */
+	void addSpikes(int channel_idx, int sorted_id, int stim_class, const int* bins, int n_spikes);
+
+	/** Gives an existing row its block ahead of addSpikes(); writer thread only */
+	void reserveRow(int channel_idx, int sorted_id, int stim_class);
+
+	/** Returns a view of a row; counts is nullptr if the row does not exist or has no spikes.
+		Reads the state as of the last completed write */
+	HistogramView getView(int channel_idx, int sorted_id, int stim_class) const;
+
+	/** Counts one more trial for a stim class */
+	void addTrial(int stim_class);
+
+	/** Number of trials recorded for a stim class (0 if out of range) */
+	int getNumTrials(int stim_class) const;
+
+	/** Sets every count and trial count to zero, keeping the current shape */
+	void zero();
+
+	/** Releases all storage and resets the channel, unit and condition extents */
+	void clear();
+
+	/** Replaces the contents with those of a tensor built off-line (e.g. by a rebin).
+		Readers see the switch as a single write; other is left empty */
+	void adopt(PSTHTensor& other);
+
+	/**
+		A copy of the blocks, one for one with the slab, kept by the caller
+		between captures so that the next capture() only copies the blocks
+		written since. Only the writer thread fills it; once filled it can be
+		read (e.g. written to disk) anywhere.
+	*/
+	struct Capture
+	{
+		uint64 epoch = 0; // slab layout the blocks were copied from; 0 until the first capture
+		uint32 version = 0; // last write included
+		PSTHBinning base;
+		PSTHBinning display;
+		int nChannels = 0;
+		int nUnits = 0;
+		int nConditions = 0;
+		bool hasMoments = false;
+		size_t rowStride = 1; // base row length + 1 prefix sums per block
+		size_t squareStride = 0; // display row length squared counts per block
+		int binFactor = 1; // base bins per displayed bin
+		int binOffset = 0; // base bin where displayed bin 0 starts
+		std::vector<int32> blockRows; // channel, unit, stim class per block; channel -1 for a block no row uses
+		std::vector<uint32> blockVersions; // version of the block's row when it was copied
+		std::vector<uint32> sums;
+		std::vector<uint32> squares;
+		std::vector<int> trialCounts;
+
+		size_t getNumBlocks() const { return blockRows.size() / 3; }
+
+		/** Raw spike count of one displayed bin of a block, as HistogramView::getCount() */
+		uint32 getCount(size_t block, int bin) const
+		{
+			const uint32* cumulative = sums.data() + block * rowStride;
+			int first = binOffset + bin * binFactor;
+			return cumulative[first + binFactor] - cumulative[first];
+		}
+	};
+
+	/** Brings a capture up to date: O(blocks) to find the blocks written since it
+		was last filled, plus a copy of those. A re-layout, zero(), clear(), adopt()
+		or display switch since then copies every block. Writer thread only */
+	void capture(Capture& capture) const;
+
+	/** Replaces the contents with n_blocks blocks laid out as in a Capture (e.g. straight
+		from a mapped session file), taking them over as the slab. Blocks of rows outside
+		the extents are ignored. squares may be nullptr if the variances are not known */
+	void restore(const PSTHBinning& base, const PSTHBinning& display, int n_channels, int n_units, int n_conditions,
+		size_t n_blocks, const int32* block_rows, const uint32* sums, const uint32* squares, const int* trial_counts);
+
+	/** Where future re-layouts put the counts; existing buffers stay where they are */
+	void setStoragePolicy(const TensorBuffer::Policy& policy) { storage = policy; }
+	const TensorBuffer::Policy& getStoragePolicy() const { return storage; }
+
+	/** True if the counts currently live in a memory-mapped file */
+	bool isFileBacked() const { return data.isFileBacked(); }
+
+	/** Number of rows that have a block, i.e. have seen a spike */
+	size_t getNumBlocks() const { return nBlocks; }
+
+	int getNumChannels() const { return nChannels; }
+	int getNumUnits() const { return nUnits; }
+	int getNumConditions() const { return nConditions; }
+	const PSTHBinning& getBaseBinning() const { return base; }
+	const PSTHBinning& getBinning() const { return display; }
+
+	/** False after a display switch with trials recorded: variances read as 0 until a rebuild */
+	bool hasMoments() const { return momentsValid; }
+
+private:
+	/** Entry of the unit table: the page of one (channel, unit) */
+	struct UnitSlot
+	{
+		int32 channel = -1; // -1: empty
+		int32 unit = 0;
+		uint32 page = 0;
+	};
+
+	/** What getView() reads, as of the end of a write. A published Layout is never
+		changed; the buffers it points to are retired rather than freed while a reader
+		may still hold it, though the writer keeps filling the current ones in place */
+	struct Layout
+	{
+		int nChannels = 0;
+		int nUnits = 0;
+		int nConditions = 0;
+		const UnitSlot* unitSlots = nullptr; // unitMask + 1
+		size_t unitMask = 0;
+		const uint32* pages = nullptr; // pageCapacity * conditionCapacity
+		size_t pageCapacity = 0;
+		size_t conditionCapacity = 0;
+		const uint32* data = nullptr; // blockCapacity * rowStride
+		const uint32* squares = nullptr; // blockCapacity * squareStride
+		const uint32* blockVersions = nullptr; // blockCapacity
+		size_t blockCapacity = 0;
+		size_t rowStride = 1;
+		size_t squareStride = 0;
+		const int* trialCounts = nullptr; // nConditions entries at least
+		const uint32* conditionVersions = nullptr;
+		PSTHBinning display;
+		int binFactor = 1;
+		int binOffset = 0;
+		bool momentsValid = true;
+	};
+
+	void beginWrite();
+	void endWrite();
+
+	/** Publishes the current state for readers if it differs from the published Layout */
+	void publish();
+
+	/** Moves the data into pages of condition_capacity stim classes and rows of n_bins base bins */
+	void relayout(int condition_capacity, int n_bins);
+
+	/** Takes the next block of the slab for a row, growing the slab if full. Returns the block */
+	size_t allocateBlock(int channel_idx, int sorted_id, int stim_class);
+
+	static uint32 hashUnit(int channel_idx, int sorted_id);
+
+	/** Page of (channel_idx, sorted_id), or -1 if the unit has none yet */
+	int64 findPage(int channel_idx, int sorted_id) const;
+
+	/** Index entry of a row: block + 1, or 0 if it has no block */
+	uint32 findRow(int channel_idx, int sorted_id, int stim_class) const;
+
+	/** Index entry of a row, giving its unit a page first if it has none */
+	uint32& rowEntry(int channel_idx, int sorted_id, int stim_class);
+
+	/** Gives (channel_idx, sorted_id) the next page, growing the pages and the unit table if needed */
+	size_t addPage(int channel_idx, int sorted_id);
+
+	/** Replaces the squared counts with new_squares, all zero and allocated by the caller
+		for the displayed layout before changing anything */
+	void resetMoments(TensorBuffer new_squares);
+
+	/** Frees the buffers replaced by relayout() once no reader can still hold them */
+	void reclaim();
+
+	TensorBuffer data; // block * rowStride + base bin, as prefix sums
+	TensorBuffer squares; // block * squareStride + displayed bin, summed over trials
+	TensorBuffer::Policy storage;
+	std::vector<UnitSlot> unitSlots; // open addressing, a power of two at most half full
+	std::vector<uint32> pages; // page * conditionCapacity + stim class: block + 1, or 0 while the row has no spikes
+	std::vector<int32> pageUnits; // page: channel, unit; writer only
+	size_t nPages = 0;
+	size_t pageCapacity = 0;
+	size_t nBlocks = 0;
+	size_t blockCapacity = 0;
+	std::vector<int32> blockRows; // block: channel, unit, stim class, or channel -1 once orphaned; writer only
+	std::vector<uint32> blockVersions; // block: version of the last write to its row
+	uint64 layoutEpoch = 1; // bumped whenever blocks are renumbered or rewritten wholesale, see capture()
+	std::vector<int> trialCounts; // conditionCapacity
+	std::vector<uint32> conditionVersions; // conditionCapacity
+
+	/* logical extents */
+	int nChannels = 0;
+	int nUnits = 0;
+	int nConditions = 0;
+	int nBins = 0; // base row length
+	size_t rowStride = 1; // nBins + 1 prefix sums
+	PSTHBinning base;
+	PSTHBinning display;
+	int binFactor = 1; // base bins per displayed bin
+	int binOffset = 0; // base bin where displayed bin 0 starts
+	size_t squareStride = 0; // displayed row length
+	bool momentsValid = true;
+
+	int conditionCapacity = 0; // stim classes per page
+
+	/* seqlock state */
+	std::atomic<uint32> sequence{ 0 };
+	mutable std::atomic<int> activeReaders{ 0 };
+	int writeDepth = 0;
+	uint32 writeVersion = 0; // version stamped on everything changed by the current write
+	uint32 lastVersion = 0;
+	std::vector<std::vector<uint32>> retired;
+	std::vector<std::vector<UnitSlot>> retiredUnitSlots;
+	std::vector<TensorBuffer> retiredBuffers;
+	std::vector<std::vector<int>> retiredTrialCounts;
+
+	std::unique_ptr<Layout> layout; // the published one
+	std::atomic<const Layout*> publishedLayout{ nullptr };
+	std::vector<std::unique_ptr<Layout>> retiredLayouts;
+};
+
+#endif // PSTHTENSOR_H_DEFINED
@@ -0,0 +1,386 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "SessionSnapshot.h"
+
+#include <algorithm>
+#include <cstring>
+
+static_assert(sizeof(SessionSnapshot::Header) == 152, "session file header layout");
+static_assert(sizeof(SessionSnapshot::LogEntry) == 24, "session file log entry layout");
+
+static const char snapshotMagic[8] = { 'S', 'Y', 'N', 'C', 'P', 'S', 'T', 'H' };
+
+/* Appends bytes and keeps track of the position, so sections can be aligned */
+class SectionWriter
+{
+public:
+	SectionWriter(FileOutputStream& s) : stream(s) {}
+
+	void write(const void* data, size_t size)
+	{
+		ok = ok && (size == 0 || stream.write(data, size));
+		position += size;
+	}
+
+	void writeUint32(uint32 value) { write(&value, sizeof(value)); }
+
+	/** Pads to the next 8-byte boundary and returns the offset of the section that starts there */
+	uint64 beginSection()
+	{
+		static const uint8 zeros[8] = {};
+		write(zeros, (8 - position % 8) % 8);
+		return position;
+	}
+
+	bool ok = true;
+	uint64 position = 0;
+
+private:
+	FileOutputStream& stream;
+};
+
+bool SessionSnapshot::write(const File& file) const
+{
+	File temp = file.getSiblingFile(file.getFileName() + ".tmp");
+	temp.deleteFile(); // FileOutputStream appends to an existing file
+	file.getParentDirectory().createDirectory();
+
+	Header header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+	header.version = version;
+	header.headerSize = sizeof(Header);
+	const PSTHTensor::Capture& t = *tensor;
+	const PSTHBinning* binnings[] = { &t.base, &t.display };
+	int32* fields[] = { header.baseBinning, header.displayBinning };
+	for (int i = 0; i < 2; i++)
+	{
+		fields[i][0] = binnings[i]->nBins;
+		fields[i][1] = binnings[i]->binSize;
+		fields[i][2] = binnings[i]->preBins;
+	}
+	header.nChannels = t.nChannels;
+	header.nUnits = t.nUnits;
+	header.nConditions = t.nConditions;
+	header.nTrials = nTrials;
+	header.hasMoments = t.hasMoments ? 1 : 0;
+	header.nImages = (int32)images.size();
+	header.nLogTrials = log.trials.size();
+
+	/* blocks no row uses any more are left out */
+	std::vector<size_t> blocks;
+	blocks.reserve(t.getNumBlocks());
+	for (size_t block = 0; block < t.getNumBlocks(); block++)
+	{
+		if (t.blockRows[block * 3] >= 0)
+		{
+			blocks.push_back(block);
+		}
+	}
+	header.nBlocks = blocks.size();
+
+	bool ok;
+	{
+		FileOutputStream stream(temp);
+		if (stream.failedToOpen())
+		{
+			return false;
+		}
+		SectionWriter out(stream);
+		out.write(&header, sizeof(header)); // placeholder, rewritten with the offsets
+
+		header.blocksOffset = out.beginSection();
+		for (size_t block : blocks)
+		{
+			out.write(t.blockRows.data() + block * 3, 3 * sizeof(int32));
+		}
+		header.sumsOffset = out.beginSection();
+		for (size_t block : blocks)
+		{
+			out.write(t.sums.data() + block * t.rowStride, t.rowStride * sizeof(uint32));
+		}
+		header.squaresOffset = out.beginSection();
+		if (t.hasMoments)
+		{
+			for (size_t block : blocks)
+			{
+				out.write(t.squares.data() + block * t.squareStride, t.squareStride * sizeof(uint32));
+			}
+		}
+		header.trialCountsOffset = out.beginSection();
+		out.write(t.trialCounts.data(), t.trialCounts.size() * sizeof(int));
+
+		header.namesOffset = out.beginSection();
+		for (const String& name : conditionNames)
+		{
+			size_t length = name.getNumBytesAsUTF8();
+			out.writeUint32(uint32(length));
+			out.write(name.toRawUTF8(), length);
+		}
+		header.imagesOffset = out.beginSection();
+		for (const auto& image : images)
+		{
+			out.writeUint32(uint32(image.second));
+			out.writeUint32(uint32(image.first.size()));
+			out.write(image.first.data(), image.first.size());
+		}
+
+		header.logIndexOffset = out.beginSection();
+		uint64 offset = 0;
+		for (const TrialLog::Trial& trial : log.trials)
+		{
+			LogEntry entry{ trial.stimClass, trial.sampleClock ? 1u : 0u, offset, trial.length };
+			out.write(&entry, sizeof(entry));
+			offset += trial.length;
+		}
+		header.logDataOffset = out.beginSection();
+		for (const TrialLog::Trial& trial : log.trials)
+		{
+			out.write(trial.data, trial.length);
+		}
+		header.fileSize = out.position;
+
+		ok = out.ok && stream.setPosition(0) && stream.write(&header, sizeof(header));
+		stream.flush();
+	}
+	if (!ok)
+	{
+		temp.deleteFile();
+		return false;
+	}
+	return temp.moveFileTo(file);
+}
+
+SessionSnapshotFile::SessionSnapshotFile(const File& file)
+{
+	if (!file.existsAsFile())
+	{
+		return;
+	}
+	map = std::make_unique<MemoryMappedFile>(file, MemoryMappedFile::readOnly);
+	data = static_cast<const uint8*>(map->getData());
+	if (data == nullptr || !validate(map->getSize()))
+	{
+		header = nullptr;
+		map.reset();
+	}
+}
+
+PSTHBinning SessionSnapshotFile::toBinning(const int32* fields)
+{
+	PSTHBinning binning;
+	binning.nBins = fields[0];
+	binning.binSize = fields[1];
+	binning.preBins = fields[2];
+	return binning;
+}
+
+uint32 SessionSnapshotFile::readUint32(const uint8*& p)
+{
+	uint32 value;
+	std::memcpy(&value, p, sizeof(value));
+	p += sizeof(value);
+	return value;
+}
+
+bool SessionSnapshotFile::validate(size_t size)
+{
+	if (size < sizeof(SessionSnapshot::Header))
+	{
+		return false;
+	}
+	const SessionSnapshot::Header* h = reinterpret_cast<const SessionSnapshot::Header*>(data);
+	if (std::memcmp(h->magic, snapshotMagic, sizeof(h->magic)) != 0 || h->version != SessionSnapshot::version
+		|| h->headerSize != sizeof(SessionSnapshot::Header) || h->fileSize != size)
+	{
+		return false;
+	}
+	for (const int32* fields : { h->baseBinning, h->displayBinning })
+	{
+		if (fields[0] <= 0 || fields[1] <= 0 || fields[2] < 0 || int64(fields[0]) + fields[2] > (1 << 24))
+		{
+			return false;
+		}
+	}
+	if (!PSTHTensor::canDisplay(toBinning(h->baseBinning), toBinning(h->displayBinning)))
+	{
+		return false;
+	}
+	if (h->nChannels < 0 || h->nUnits < 0 || h->nConditions < 0 || h->nImages < 0 || h->nTrials < 0)
+	{
+		return false;
+	}
+
+	/* a section fits if it starts aligned and ends before the next one; sizes are
+	   computed in 64 bits from extents bounded by the file size, so they cannot wrap */
+	auto fits = [&](uint64 offset, uint64 count, uint64 itemSize, uint64 end)
+	{
+		return offset % 8 == 0 && offset <= end && end <= size && (itemSize == 0 || count <= (end - offset) / itemSize);
+	};
+	uint64 rows = uint64(h->nChannels) * uint64(h->nUnits); // < 2^62
+	if (rows > size || (rows != 0 && uint64(h->nConditions) > size / rows))
+	{
+		return false;
+	}
+	rows *= uint64(h->nConditions);
+	uint64 baseRow = uint64(h->baseBinning[0] + h->baseBinning[2]) + 1;
+	uint64 displayRow = uint64(h->displayBinning[0] + h->displayBinning[2]);
+	/* every row has at most one block, and the blocks themselves bound nBlocks by the file size */
+	if (h->nBlocks > rows || h->nBlocks > size)
+	{
+		return false;
+	}
+	if (h->blocksOffset < sizeof(SessionSnapshot::Header)
+		|| !fits(h->blocksOffset, h->nBlocks, 12, h->sumsOffset)
+		|| !fits(h->sumsOffset, h->nBlocks * baseRow, 4, h->squaresOffset)
+		|| !fits(h->squaresOffset, h->hasMoments ? h->nBlocks * displayRow : 0, 4, h->trialCountsOffset)
+		|| !fits(h->trialCountsOffset, uint64(h->nConditions), 4, h->namesOffset)
+		|| !fits(h->namesOffset, 0, 0, h->imagesOffset)
+		|| !fits(h->imagesOffset, 0, 0, h->logIndexOffset)
+		|| !fits(h->logIndexOffset, h->nLogTrials, sizeof(SessionSnapshot::LogEntry), h->logDataOffset)
+		|| !fits(h->logDataOffset, 0, 0, size))
+	{
+		return false;
+	}
+
+	const int32* blockRows = reinterpret_cast<const int32*>(data + h->blocksOffset);
+	for (uint64 i = 0; i < h->nBlocks; i++)
+	{
+		const int32* row = blockRows + 3 * i;
+		if (row[0] < 0 || row[0] >= h->nChannels || row[1] < 0 || row[1] >= h->nUnits || row[2] < 0 || row[2] >= h->nConditions)
+		{
+			return false;
+		}
+	}
+
+	/* the variable-length sections */
+	const uint8* p = data + h->namesOffset;
+	const uint8* end = data + h->imagesOffset;
+	for (int i = 0; i < h->nConditions; i++)
+	{
+		if (end - p < 4)
+		{
+			return false;
+		}
+		uint32 length = readUint32(p);
+		if (uint64(end - p) < length)
+		{
+			return false;
+		}
+		p += length;
+	}
+	p = data + h->imagesOffset;
+	end = data + h->logIndexOffset;
+	for (int i = 0; i < h->nImages; i++)
+	{
+		if (end - p < 8 || readUint32(p) >= uint32(h->nConditions))
+		{
+			return false;
+		}
+		uint32 length = readUint32(p);
+		if (uint64(end - p) < length)
+		{
+			return false;
+		}
+		p += length;
+	}
+	const SessionSnapshot::LogEntry* entries = reinterpret_cast<const SessionSnapshot::LogEntry*>(data + h->logIndexOffset);
+	uint64 logSize = size - h->logDataOffset;
+	for (uint64 i = 0; i < h->nLogTrials; i++)
+	{
+		if (entries[i].length == 0 || entries[i].offset > logSize || entries[i].length > logSize - entries[i].offset)
+		{
+			return false;
+		}
+		/* the records are decoded later without bounds checks */
+		if (entries[i].stimClass < 0 || entries[i].stimClass >= h->nConditions
+			|| !TrialLog::isValidRecord(data + h->logDataOffset + entries[i].offset, size_t(entries[i].length), h->nConditions))
+		{
+			return false;
+		}
+	}
+	header = h;
+	return true;
+}
+
+SessionSnapshotWriter::SessionSnapshotWriter()
+	: Thread("SyncSinkSnapshotThread")
+{
+}
+
+SessionSnapshotWriter::~SessionSnapshotWriter()
+{
+	if (!stopThread(5000)) {
+		std::cerr << "Snapshot thread timeout." << std::endl;
+	}
+}
+
+void SessionSnapshotWriter::submit(std::unique_ptr<SessionSnapshot> snapshot, const File& file)
+{
+	{
+		const ScopedLock sl(lock);
+		auto same = std::find_if(pending.begin(), pending.end(), [&](const auto& entry) { return entry.first == file; });
+		if (same != pending.end())
+		{
+			same->second = std::move(snapshot);
+		}
+		else
+		{
+			pending.emplace_back(file, std::move(snapshot));
+		}
+	}
+	notify();
+}
+
+void SessionSnapshotWriter::run()
+{
+	/* a snapshot submitted before the thread is stopped (e.g. on exit) is still written */
+	for (;;)
+	{
+		std::unique_ptr<SessionSnapshot> snapshot;
+		File file;
+		{
+			const ScopedLock sl(lock);
+			if (!pending.empty())
+			{
+				file = pending.front().first;
+				snapshot = std::move(pending.front().second);
+				pending.erase(pending.begin());
+			}
+		}
+		if (snapshot == nullptr)
+		{
+			if (threadShouldExit())
+			{
+				return;
+			}
+			wait(-1);
+			continue;
+		}
+		if (!snapshot->write(file))
+		{
+			std::cout << "SessionSnapshotWriter::run(): could not write " << file.getFullPathName() << std::endl;
+		}
+	}
+}
@@ -0,0 +1,213 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SESSIONSNAPSHOT_H_DEFINED
+#define SESSIONSNAPSHOT_H_DEFINED
+
+#include <ProcessorHeaders.h>
+
+#include "PSTHTensor.h"
+#include "TrialLog.h"
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/**
+	The PSTH state of a session: design, bin layouts, spike tensor and trial
+	log, as captured on the engine thread between two commands. Capturing
+	brings a PSTHTensor::Capture up to date (copying only the blocks written
+	since the previous capture) and shares the trial log chunks, so it is
+	consistent without stopping acquisition; writing happens elsewhere.
+
+	File layout (host byte order, every section on an 8-byte boundary):
+
+		Header
+		blocks        per allocated row: int32 channel, unit, stim class
+		sums          per block: base row length + 1 uint32 prefix sums
+		squares       per block: display row length uint32 squared counts (empty unless hasMoments)
+		trial counts  per stim class: int32
+		names         per stim class: uint32 length, UTF-8 name
+		images        per image id: uint32 stim class, uint32 length, UTF-8 id
+		log index     per logged trial: LogEntry
+		log data      the TrialLog records, back to back
+*/
+class SessionSnapshot
+{
+public:
+	struct Header
+	{
+		char magic[8]; // "SYNCPSTH"
+		uint32 version;
+		uint32 headerSize;
+		int32 baseBinning[3]; // nBins, binSize, preBins
+		int32 displayBinning[3];
+		int32 nChannels;
+		int32 nUnits;
+		int32 nConditions;
+		int32 nTrials;
+		int32 hasMoments;
+		int32 nImages;
+		uint64 nLogTrials;
+		uint64 nBlocks;
+		uint64 blocksOffset;
+		uint64 sumsOffset;
+		uint64 squaresOffset;
+		uint64 trialCountsOffset;
+		uint64 namesOffset;
+		uint64 imagesOffset;
+		uint64 logIndexOffset;
+		uint64 logDataOffset;
+		uint64 fileSize;
+	};
+
+	struct LogEntry
+	{
+		int32 stimClass;
+		uint32 sampleClock;
+		uint64 offset; // into the log data
+		uint64 length;
+	};
+
+	static const uint32 version = 2;
+
+	std::shared_ptr<const PSTHTensor::Capture> tensor; // held until written, so not refilled meanwhile
+	int nTrials = 0; // trials started, as shown on the canvas
+	std::vector<String> conditionNames; // by stim class
+	std::vector<std::pair<std::string, int>> images; // image id, stim class
+	TrialLog::Snapshot log;
+
+	/** Writes to a sibling temporary file and renames it over file, so a
+		crash while writing leaves the previous snapshot intact */
+	bool write(const File& file) const;
+};
+
+/**
+	A session file mapped read-only. The sections are validated once and then
+	used in place: the tensor rows and trial records are copied straight out
+	of the mapping, nothing is parsed but the names.
+*/
+class SessionSnapshotFile
+{
+public:
+	explicit SessionSnapshotFile(const File& file);
+
+	/** False if the file is missing, truncated or from another version */
+	bool isValid() const { return header != nullptr; }
+
+	const SessionSnapshot::Header& getHeader() const { return *header; }
+	PSTHBinning getBaseBinning() const { return toBinning(header->baseBinning); }
+	PSTHBinning getDisplayBinning() const { return toBinning(header->displayBinning); }
+
+	size_t getNumBlocks() const { return size_t(header->nBlocks); }
+	const int32* getBlockRows() const { return reinterpret_cast<const int32*>(data + header->blocksOffset); }
+	const uint32* getSums() const { return reinterpret_cast<const uint32*>(data + header->sumsOffset); }
+
+	/** nullptr if the variances were being rebuilt when the snapshot was taken */
+	const uint32* getSquares() const
+	{
+		return header->hasMoments ? reinterpret_cast<const uint32*>(data + header->squaresOffset) : nullptr;
+	}
+
+	const int* getTrialCounts() const { return reinterpret_cast<const int*>(data + header->trialCountsOffset); }
+
+	/** Calls callback(const String& name) for every stim class, in order */
+	template <typename Callback>
+	void forEachCondition(Callback&& callback) const
+	{
+		const uint8* p = data + header->namesOffset;
+		for (int i = 0; i < header->nConditions; i++)
+		{
+			uint32 length = readUint32(p);
+			callback(String::fromUTF8(reinterpret_cast<const char*>(p), (int)length));
+			p += length;
+		}
+	}
+
+	/** Calls callback(std::string_view image_id, int stim_class) for every image id */
+	template <typename Callback>
+	void forEachImage(Callback&& callback) const
+	{
+		const uint8* p = data + header->imagesOffset;
+		for (int i = 0; i < header->nImages; i++)
+		{
+			int stimClass = (int)readUint32(p);
+			uint32 length = readUint32(p);
+			callback(std::string_view(reinterpret_cast<const char*>(p), length), stimClass);
+			p += length;
+		}
+	}
+
+	/** Calls callback(int stim_class, bool sample_clock, const uint8* record, size_t length) for every logged trial */
+	template <typename Callback>
+	void forEachTrial(Callback&& callback) const
+	{
+		const SessionSnapshot::LogEntry* entries = reinterpret_cast<const SessionSnapshot::LogEntry*>(data + header->logIndexOffset);
+		for (uint64 i = 0; i < header->nLogTrials; i++)
+		{
+			callback(entries[i].stimClass, entries[i].sampleClock != 0, data + header->logDataOffset + entries[i].offset, size_t(entries[i].length));
+		}
+	}
+
+private:
+	static PSTHBinning toBinning(const int32* fields);
+
+	/** Reads an unaligned uint32 and advances p */
+	static uint32 readUint32(const uint8*& p);
+
+	/** Checks every section against the file size; false leaves header nullptr */
+	bool validate(size_t size);
+
+	std::unique_ptr<MemoryMappedFile> map;
+	const uint8* data = nullptr;
+	const SessionSnapshot::Header* header = nullptr;
+
+	JUCE_DECLARE_NON_COPYABLE(SessionSnapshotFile);
+};
+
+/**
+	Writes captured snapshots on a background thread, so periodic saves
+	never hold up the engine. Only the newest pending snapshot of each file
+	is written.
+*/
+class SessionSnapshotWriter : public Thread
+{
+public:
+	SessionSnapshotWriter();
+	~SessionSnapshotWriter();
+
+	/** Queues a snapshot, replacing one for the same file that has not been written yet */
+	void submit(std::unique_ptr<SessionSnapshot> snapshot, const File& file);
+
+	void run() override;
+
+private:
+	CriticalSection lock; // guards pending
+	std::vector<std::pair<File, std::unique_ptr<SessionSnapshot>>> pending; // in submission order
+
+	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SessionSnapshotWriter);
+};
+
+#endif // SESSIONSNAPSHOT_H_DEFINED
@@ -0,0 +1,236 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "ShardedBinner.h"
+
+#include <algorithm>
+
+ShardedBinner::ShardedBinner()
+	: scratch(1)
+{
+}
+
+ShardedBinner::~ShardedBinner()
+{
+	setNumShards(0);
+}
+
+void ShardedBinner::setNumShards(int n_shards)
+{
+	for (auto& worker : workers)
+	{
+		if (!worker->stopThread(1000))
+		{
+			std::cout << "ShardedBinner::setNumShards(): bin thread timeout" << std::endl;
+		}
+	}
+	workers.clear();
+	scratch.assign(jmax(1, n_shards), Scratch());
+	for (int shard = 0; shard < n_shards; shard++)
+	{
+		workers.push_back(std::make_unique<Worker>(*this, shard));
+		workers.back()->startThread();
+	}
+}
+
+void ShardedBinner::start(PSTHTensor& tensor, int stim_class, bool sample_clock,
+	const std::vector<TrialLog::Spike>& spikes, const std::vector<int64>& sample_rates)
+{
+	batch.tensor = &tensor;
+	batch.stimClass = stim_class;
+	batch.spikes = spikes.data();
+	batch.groups.clear();
+	batch.applying = false;
+	if (stim_class >= 0 && stim_class < tensor.getNumConditions())
+	{
+		/* re-layouts and block allocation are not thread-safe, so the rows are made
+		   ready here, before any worker writes to them; readers retry at most once */
+		PSTHTensor::WriteScope write(tensor);
+		size_t begin = 0;
+		for (size_t i = 1; i <= spikes.size(); i++)
+		{
+			if (i == spikes.size() || spikes[i].channelIdx != spikes[begin].channelIdx
+				|| spikes[i].sortedId != spikes[begin].sortedId || spikes[i].streamId != spikes[begin].streamId)
+			{
+				addGroup(begin, i, sample_clock, sample_rates);
+				begin = i;
+			}
+		}
+	}
+
+	if (workers.empty() || batch.groups.empty())
+	{
+		map(batch, -1);
+		return;
+	}
+	postWorkers();
+}
+
+void ShardedBinner::finish()
+{
+	waitWorkers();
+	if (batch.tensor != nullptr)
+	{
+		/* the write section only spans the row updates: the bins are mapped already */
+		PSTHTensor::WriteScope write(*batch.tensor);
+		if (workers.empty() || batch.groups.empty())
+		{
+			apply(batch, -1);
+		}
+		else
+		{
+			batch.applying = true;
+			postWorkers();
+			waitWorkers();
+		}
+		batch.tensor->addTrial(batch.stimClass);
+	}
+	batch.tensor = nullptr;
+	batch.spikes = nullptr;
+}
+
+void ShardedBinner::postWorkers()
+{
+	remaining = (int)workers.size();
+	posted = true;
+	for (auto& worker : workers)
+	{
+		worker->post(&batch);
+	}
+}
+
+void ShardedBinner::waitWorkers()
+{
+	if (posted)
+	{
+		finished.wait();
+		posted = false;
+	}
+}
+
+void ShardedBinner::addGroup(size_t begin, size_t end, bool sample_clock, const std::vector<int64>& sample_rates)
+{
+	const TrialLog::Spike& first = batch.spikes[begin];
+	int64 samplesPerSecond = 0;
+	if (sample_clock)
+	{
+		if (first.streamId < 0 || first.streamId >= sample_rates.size() || sample_rates[first.streamId] <= 0)
+		{
+			return;
+		}
+		samplesPerSecond = sample_rates[first.streamId];
+	}
+
+	/* the bins ascend with the offsets: the group reaches the window if its
+	   first spike past the window start is still inside it */
+	const PSTHBinning& binning = batch.tensor->getBaseBinning();
+	const TrialLog::Spike* inWindow = std::partition_point(batch.spikes + begin, batch.spikes + end,
+		[&](const TrialLog::Spike& spike) { return binning.getBin(spike.offset, samplesPerSecond) < 0; });
+	if (inWindow == batch.spikes + end || binning.getBin(inWindow->offset, samplesPerSecond) >= binning.getRowLength())
+	{
+		return;
+	}
+
+	batch.tensor->ensure(first.channelIdx, first.sortedId);
+	batch.tensor->reserveRow(first.channelIdx, first.sortedId, batch.stimClass);
+	batch.groups.push_back({ begin, end, samplesPerSecond });
+}
+
+void ShardedBinner::map(const Batch& batch_, int shard)
+{
+	const PSTHBinning& binning = batch_.tensor->getBaseBinning();
+	int nShards = (int)workers.size();
+	Scratch& out = scratch[jmax(0, shard)];
+	out.runs.clear();
+	out.bins.clear();
+	static thread_local std::vector<int64> offsets;
+	static thread_local std::vector<int> bins;
+	for (size_t g = 0; g < batch_.groups.size(); g++)
+	{
+		const Group& group = batch_.groups[g];
+		if (shard >= 0 && batch_.spikes[group.begin].channelIdx % nShards != shard)
+		{
+			continue;
+		}
+		/* a group's offsets are in ascending order, so its bins are too */
+		offsets.clear();
+		for (size_t i = group.begin; i < group.end; i++)
+		{
+			offsets.push_back(batch_.spikes[i].offset);
+		}
+		int count = 0;
+		const int* window = binning.getWindowBins(offsets, group.samplesPerSecond, bins, count);
+		out.runs.push_back({ g, out.bins.size(), count });
+		out.bins.insert(out.bins.end(), window, window + count);
+	}
+}
+
+void ShardedBinner::apply(const Batch& batch_, int shard)
+{
+	const Scratch& in = scratch[jmax(0, shard)];
+	for (const Scratch::Run& run : in.runs)
+	{
+		const TrialLog::Spike& first = batch_.spikes[batch_.groups[run.group].begin];
+		batch_.tensor->addSpikes(first.channelIdx, first.sortedId, batch_.stimClass, in.bins.data() + run.begin, run.count);
+	}
+}
+
+ShardedBinner::Worker::Worker(ShardedBinner& owner_, int shard_)
+	: Thread("SyncSinkBinThread"), owner(owner_), shard(shard_), jobs(4)
+{
+}
+
+void ShardedBinner::Worker::post(const Batch* batch)
+{
+	/* the engine waits for every batch before posting the next one */
+	bool posted = jobs.push(batch);
+	jassert(posted);
+	ignoreUnused(posted);
+	notify();
+}
+
+void ShardedBinner::Worker::run()
+{
+	while (!threadShouldExit())
+	{
+		const Batch** job = jobs.front();
+		if (job == nullptr)
+		{
+			wait(100);
+			continue;
+		}
+		if ((*job)->applying)
+		{
+			owner.apply(**job, shard);
+		}
+		else
+		{
+			owner.map(**job, shard);
+		}
+		jobs.pop();
+		if (owner.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			owner.finished.signal();
+		}
+	}
+}
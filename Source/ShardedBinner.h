@@ -0,0 +1,144 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SHARDEDBINNER_H_DEFINED
+#define SHARDEDBINNER_H_DEFINED
+
+#include <ProcessorHeaders.h>
+
+#include "PSTHTensor.h"
+#include "SpscQueue.h"
+#include "TrialLog.h"
+
+/**
+	Bins committed trials into a spike tensor on worker threads, sharded by
+	spike channel.
+
+	The engine remains the tensor's writer as far as readers and the layout
+	are concerned. start() gives every row that gets a spike in the window
+	a block in one short write section (a unit whose spikes all fall outside
+	the window gets no row), then posts the trial to each shard's lock-free
+	queue. A worker maps the spike groups of its channels (channel % number
+	of shards) to bins in its own scratch, without touching the tensor; the
+	engine can do other work for the trial meanwhile. finish() waits for
+	the workers, opens the write section and has them add their scratch to
+	the tensor, counts and squared counts alike, so no two threads ever touch
+	the same row. Readers only retry while the rows are being updated.
+
+	With no shards, the calling thread does both steps.
+*/
+class ShardedBinner
+{
+public:
+	ShardedBinner();
+	~ShardedBinner();
+
+	/** Replaces the workers with n_shards new ones; 0 bins on the engine thread.
+		Engine thread, outside start() / finish() */
+	void setNumShards(int n_shards);
+	int getNumShards() const { return (int)workers.size(); }
+
+	/** Starts binning one trial's spikes into stim_class of tensor. spikes must be sorted
+		as TrialLog::append() leaves them and must not change until finish() */
+	void start(PSTHTensor& tensor, int stim_class, bool sample_clock,
+		const std::vector<TrialLog::Spike>& spikes, const std::vector<int64>& sample_rates);
+
+	/** Waits for the workers, adds the trial's bins and counts the trial in one write section */
+	void finish();
+
+private:
+	/** Spikes [begin, end) of one (channel, unit, stream), at least one of them in the window */
+	struct Group
+	{
+		size_t begin;
+		size_t end;
+		int64 samplesPerSecond; // 0 unless the trial is aligned on the sample clock
+	};
+
+	/** The trial being binned; written by the engine, read-only for the workers */
+	struct Batch
+	{
+		PSTHTensor* tensor = nullptr;
+		int stimClass = -1;
+		const TrialLog::Spike* spikes = nullptr;
+		std::vector<Group> groups; // only those with a row reserved
+		bool applying = false; // false: map spikes to bins; true: add the bins to the tensor
+	};
+
+	/** Window bins of one shard's groups, between the two steps */
+	struct Scratch
+	{
+		struct Run
+		{
+			size_t group;
+			size_t begin; // in bins
+			int count;
+		};
+		std::vector<Run> runs;
+		std::vector<int> bins;
+	};
+
+	class Worker : public Thread
+	{
+	public:
+		Worker(ShardedBinner& owner, int shard);
+
+		/** Engine thread: hands the worker a batch */
+		void post(const Batch* batch);
+
+		void run() override;
+
+	private:
+		ShardedBinner& owner;
+		int shard;
+		SpscQueue<const Batch*> jobs;
+	};
+
+	/** Adds spikes [begin, end), which must all be of the same (channel, unit, stream),
+		to batch.groups if any of them falls in the window */
+	void addGroup(size_t begin, size_t end, bool sample_clock, const std::vector<int64>& sample_rates);
+
+	/** Maps the spikes of the groups whose channel belongs to shard to window bins,
+		or of every group if shard < 0 */
+	void map(const Batch& batch, int shard);
+
+	/** Adds the bins mapped by map() for shard to the tensor; inside the write section */
+	void apply(const Batch& batch, int shard);
+
+	/** Hands the batch to every worker */
+	void postWorkers();
+
+	/** Waits for the workers to finish the batch, if it was posted */
+	void waitWorkers();
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	Batch batch;
+	std::vector<Scratch> scratch; // per shard, or one with no shards
+	std::atomic<int> remaining{ 0 }; // workers still on the batch
+	bool posted = false; // the batch went to the workers, which have not all finished it
+	WaitableEvent finished;
+
+	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ShardedBinner);
+};
+
+#endif // SHARDEDBINNER_H_DEFINED
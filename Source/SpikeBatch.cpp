@@ -0,0 +1,86 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "SpikeBatch.h"
+
+#include <algorithm>
+
+SpikeBatch::SpikeBatch()
+{
+	sampleNumber.reserve(capacity);
+	timestamp.reserve(capacity);
+	channelIdx.reserve(capacity);
+	sortedId.reserve(capacity);
+	streamId.reserve(capacity);
+}
+
+void SpikeBatch::add(int channel_idx, int sorted_id, int stream_id, int64 sample_number)
+{
+	sampleNumber.push_back(sample_number);
+	channelIdx.push_back(channel_idx);
+	sortedId.push_back(sorted_id);
+	streamId.push_back(stream_id);
+}
+
+void SpikeBatch::clear()
+{
+	sampleNumber.clear();
+	timestamp.clear();
+	channelIdx.clear();
+	sortedId.clear();
+	streamId.clear();
+}
+
+void SpikeBatch::stamp(const std::vector<double>& samples_per_ms, int64 start_timestamp)
+{
+	/* one gather and one division per spike, no calls or branches, so the loop vectorizes */
+	int n = size();
+	timestamp.resize(n);
+	const double* rates = samples_per_ms.data();
+	for (int i = 0; i < n; i++)
+	{
+		timestamp[i] = (int64)((double)sampleNumber[i] / rates[streamId[i]] + start_timestamp);
+	}
+}
+
+void SpikeBatch::write(char* record) const
+{
+	int n = size();
+	record = (char*)std::copy_n(sampleNumber.data(), n, (int64*)record);
+	record = (char*)std::copy_n(timestamp.data(), n, (int64*)record);
+	record = (char*)std::copy_n(channelIdx.data(), n, (int*)record);
+	record = (char*)std::copy_n(sortedId.data(), n, (int*)record);
+	std::copy_n(streamId.data(), n, (int*)record);
+}
+
+SpikeBatchView SpikeBatch::read(const char* record, int n)
+{
+	SpikeBatchView batch;
+	batch.size = n;
+	batch.sampleNumber = (const int64*)record;
+	batch.timestamp = batch.sampleNumber + n;
+	batch.channelIdx = (const int*)(batch.timestamp + n);
+	batch.sortedId = batch.channelIdx + n;
+	batch.streamId = batch.sortedId + n;
+	return batch;
+}
@@ -0,0 +1,82 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SPIKEBATCH_H_DEFINED
+#define SPIKEBATCH_H_DEFINED
+
+#include <ProcessorHeaders.h>
+
+#include <vector>
+
+/** A posted SpikeBatch as the engine reads it, in place in a record (see SpikeBatch::write()) */
+struct SpikeBatchView
+{
+	int size = 0;
+	const int64* sampleNumber = nullptr;
+	const int64* timestamp = nullptr;
+	const int* channelIdx = nullptr;
+	const int* sortedId = nullptr;
+	const int* streamId = nullptr;
+};
+
+/**
+	Spikes of one process() block as a structure of arrays, in the order
+	checkForEvents() delivered them. Filled by the audio thread, which then
+	stamps the whole block in one pass (see stamp()) and posts it as a
+	single engine command.
+*/
+struct SpikeBatch
+{
+	std::vector<int64> sampleNumber;
+	std::vector<int64> timestamp; // software timestamp (ms)
+	std::vector<int> channelIdx;
+	std::vector<int> sortedId;
+	std::vector<int> streamId;
+
+	static const int capacity = 8192; // spikes; a fuller block is posted in several batches
+
+	SpikeBatch();
+
+	int size() const { return (int)sampleNumber.size(); }
+	bool isFull() const { return size() >= capacity; }
+	void add(int channel_idx, int sorted_id, int stream_id, int64 sample_number);
+	void clear();
+
+	/** Converts every sample number to a software timestamp, given the samples per ms
+		of each stream (by stream id) and the timestamp of sample 0 */
+	void stamp(const std::vector<double>& samples_per_ms, int64 start_timestamp);
+
+	/** Bytes of the record of n spikes: two int64 and three int arrays, padded to 8 bytes */
+	static size_t getRecordSize(int n)
+	{
+		return (size_t(n) * (2 * sizeof(int64) + 3 * sizeof(int)) + 7) & ~size_t(7);
+	}
+
+	/** Copies the stamped batch into an 8-byte aligned record of getRecordSize(size()) bytes */
+	void write(char* record) const;
+
+	/** Reads the record of n spikes written by write(), in place */
+	static SpikeBatchView read(const char* record, int n);
+};
+
+#endif // SPIKEBATCH_H_DEFINED
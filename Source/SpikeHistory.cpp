@@ -0,0 +1,68 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "SpikeHistory.h"
+
+SpikeHistory::SpikeHistory(int capacity_per_unit)
+	: capacity(capacity_per_unit)
+{
+}
+
+void SpikeHistory::add(int channel_idx, int sorted_id, const Entry& entry)
+{
+	if (channel_idx < 0 || sorted_id < 0)
+	{
+		return;
+	}
+	if (channel_idx >= ringIndex.size())
+	{
+		ringIndex.resize(channel_idx + 1);
+	}
+	std::vector<int>& units = ringIndex[channel_idx];
+	if (sorted_id >= units.size())
+	{
+		units.resize(sorted_id + 1, -1);
+	}
+	if (units[sorted_id] < 0)
+	{
+		units[sorted_id] = rings.size();
+		rings.push_back({ channel_idx, sorted_id, std::vector<Entry>(capacity) });
+	}
+
+	Ring& ring = rings[units[sorted_id]];
+	ring.entries[ring.next] = entry;
+	ring.next = (ring.next + 1) % capacity;
+	if (ring.count < capacity)
+	{
+		ring.count++;
+	}
+}
+
+void SpikeHistory::clear()
+{
+	for (Ring& ring : rings)
+	{
+		ring.next = 0;
+		ring.count = 0;
+	}
+}
@@ -0,0 +1,96 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SPIKEHISTORY_H_DEFINED
+#define SPIKEHISTORY_H_DEFINED
+
+#include <ProcessorHeaders.h>
+
+#include <vector>
+
+/**
+	Fixed-size ring buffer of the most recent spikes of every (channel, unit).
+
+	TrialAlign reaches the engine some milliseconds after the stimulus, so the
+	first spikes of a response (and any pre-stimulus baseline) have already
+	gone by when the trial is aligned. Keeping a short history per unit lets
+	those spikes be binned retroactively.
+
+	A ring is allocated the first time a unit is seen; after that add() never
+	allocates. Old spikes are overwritten, so a busy unit cannot evict the
+	history of a quiet one.
+*/
+class SpikeHistory
+{
+public:
+	struct Entry
+	{
+		int64 sampleNumber;
+		int64 timestamp; // software timestamp (ms)
+		int streamId;
+	};
+
+	SpikeHistory(int capacity_per_unit = 256);
+
+	/** Records a spike, overwriting the oldest entry of its unit when full */
+	void add(int channel_idx, int sorted_id, const Entry& entry);
+
+	/** Calls callback(channel_idx, sorted_id, entry) for each spike with timestamp >= since */
+	template <typename Callback>
+	void forEachSince(int64 since, Callback&& callback) const
+	{
+		for (const Ring& ring : rings)
+		{
+			/* entries are appended in time order, so walk back from the newest */
+			size_t first = ring.count;
+			while (first > 0 && ring.entries[(ring.next + capacity - (ring.count - first) - 1) % capacity].timestamp >= since)
+			{
+				first--;
+			}
+			for (size_t i = first; i < ring.count; i++)
+			{
+				callback(ring.channelIdx, ring.sortedId,
+					ring.entries[(ring.next + capacity - ring.count + i) % capacity]);
+			}
+		}
+	}
+
+	/** Forgets all spikes; rings stay allocated */
+	void clear();
+
+private:
+	struct Ring
+	{
+		int channelIdx;
+		int sortedId;
+		std::vector<Entry> entries;
+		size_t next = 0; // slot the next spike is written to
+		size_t count = 0; // valid entries, <= capacity
+	};
+
+	size_t capacity;
+	std::vector<Ring> rings;
+	std::vector<std::vector<int>> ringIndex; // [channel][unit] -> index into rings, -1 if unseen
+};
+
+#endif // SPIKEHISTORY_H_DEFINED
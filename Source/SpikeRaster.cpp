@@ -0,0 +1,162 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "SpikeRaster.h"
+
+#include <algorithm>
+#include <cstring>
+
+SpikeRaster::SpikeRaster()
+{
+}
+
+void SpikeRaster::setTrialCap(int n_trials)
+{
+	trialCap.store(jmax(1, n_trials), std::memory_order_relaxed);
+}
+
+void SpikeRaster::addTrial(int trial, int stim_class)
+{
+	const ScopedLock sl(lock);
+	currentTrial = trial;
+	currentStimClass = stim_class;
+	if (stim_class < 0)
+	{
+		return;
+	}
+	if (stim_class >= conditionTrials.size())
+	{
+		conditionTrials.resize(stim_class + 1);
+	}
+	std::deque<int>& trials = conditionTrials[stim_class];
+	trials.push_back(trial);
+	while (trials.size() > getTrialCap())
+	{
+		trials.pop_front();
+	}
+}
+
+void SpikeRaster::addSpikes(int channel_idx, int sorted_id, const float* offsets, int n_spikes)
+{
+	if (n_spikes <= 0 || channel_idx < 0 || sorted_id < 0 || currentStimClass < 0)
+	{
+		return;
+	}
+	const ScopedLock sl(lock);
+	if (channel_idx >= units.size())
+	{
+		units.resize(channel_idx + 1);
+	}
+	if (sorted_id >= units[channel_idx].size())
+	{
+		units[channel_idx].resize(sorted_id + 1);
+	}
+	UnitRaster& unit = units[channel_idx][sorted_id];
+	if (currentStimClass >= unit.conditions.size())
+	{
+		unit.conditions.resize(currentStimClass + 1);
+	}
+
+	/* drop the trials that fell out of the stim class index */
+	std::deque<Entry>& entries = unit.conditions[currentStimClass];
+	int oldest = conditionTrials[currentStimClass].front();
+	while (!entries.empty() && entries.front().trial < oldest)
+	{
+		entries.pop_front();
+	}
+
+	if (unit.chunk == nullptr || unit.chunkCapacity - unit.chunkUsed < size_t(n_spikes))
+	{
+		unit.chunkCapacity = std::max(chunkSize, size_t(n_spikes));
+		unit.chunk = std::shared_ptr<float>(new float[unit.chunkCapacity], std::default_delete<float[]>());
+		unit.chunkUsed = 0;
+	}
+	float* stored = unit.chunk.get() + unit.chunkUsed;
+	std::memcpy(stored, offsets, sizeof(float) * n_spikes);
+	unit.chunkUsed += n_spikes;
+	entries.push_back({ currentTrial, unit.chunk, stored, n_spikes });
+}
+
+int SpikeRaster::getNumTrials(int stim_class) const
+{
+	const ScopedLock sl(lock);
+	if (stim_class < 0 || stim_class >= conditionTrials.size())
+	{
+		return 0;
+	}
+	return (int)conditionTrials[stim_class].size();
+}
+
+SpikeRaster::Snapshot SpikeRaster::getRows(int channel_idx, int sorted_id, int stim_class, int first, int count) const
+{
+	Snapshot s;
+	const ScopedLock sl(lock);
+	if (stim_class < 0 || stim_class >= conditionTrials.size())
+	{
+		return s;
+	}
+	const std::deque<int>& trials = conditionTrials[stim_class];
+	first = jlimit(0, (int)trials.size(), first);
+	int end = jlimit(first, (int)trials.size(), first + count);
+
+	const std::deque<Entry>* entries = nullptr;
+	if (channel_idx >= 0 && channel_idx < units.size() && sorted_id >= 0 && sorted_id < units[channel_idx].size()
+		&& stim_class < units[channel_idx][sorted_id].conditions.size())
+	{
+		entries = &units[channel_idx][sorted_id].conditions[stim_class];
+	}
+
+	/* both sequences are in trial order: one merge from the first requested trial */
+	std::deque<Entry>::const_iterator next;
+	if (entries != nullptr && first < end)
+	{
+		next = std::lower_bound(entries->begin(), entries->end(), trials[first],
+			[](const Entry& e, int trial) { return e.trial < trial; });
+	}
+	s.rows.reserve(end - first);
+	for (int i = first; i < end; i++)
+	{
+		Row row{ trials[i], nullptr, 0 };
+		if (entries != nullptr && next != entries->end() && next->trial == trials[i])
+		{
+			row.offsets = next->offsets;
+			row.nSpikes = next->nSpikes;
+			if (s.chunks.empty() || s.chunks.back() != next->chunk)
+			{
+				s.chunks.push_back(next->chunk);
+			}
+			++next;
+		}
+		s.rows.push_back(row);
+	}
+	return s;
+}
+
+void SpikeRaster::clear()
+{
+	const ScopedLock sl(lock);
+	conditionTrials.clear();
+	units.clear();
+	currentTrial = -1;
+	currentStimClass = -1;
+}
@@ -0,0 +1,114 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SPIKERASTER_H_DEFINED
+#define SPIKERASTER_H_DEFINED
+
+#include <ProcessorHeaders.h>
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+
+/**
+	Spike times of the most recent trials of every stim class, per
+	(channel, unit), for single-trial raster displays.
+
+	Each stim class keeps an index of its last getTrialCap() trials. Each
+	(channel, unit) stores the offsets of the trials it fired in as float ms
+	from TrialAlign, in a chunked arena of its own; a trial it was silent in
+	costs nothing. Entries older than the first indexed trial of their stim
+	class are dropped as new ones come in, so a unit holds at most the cap
+	times the number of stim classes trials.
+
+	The engine thread writes once per committed trial and readers copy out
+	the rows they draw under a short lock. A Snapshot shares the chunks its
+	rows point into, so it stays valid while the store moves on.
+*/
+class SpikeRaster
+{
+public:
+	struct Row
+	{
+		int trial; // index of the trial in the session's trial log
+		const float* offsets; // ms from TrialAlign, ascending; nullptr if the unit did not fire
+		int nSpikes;
+	};
+
+	/** A run of rows of one (channel, unit, stim class), oldest first */
+	struct Snapshot
+	{
+		std::vector<std::shared_ptr<float>> chunks; // keeps the offsets alive
+		std::vector<Row> rows;
+	};
+
+	SpikeRaster();
+
+	/** Number of trials kept per stim class; takes effect as new trials come in */
+	void setTrialCap(int n_trials);
+	int getTrialCap() const { return trialCap.load(std::memory_order_relaxed); }
+
+	/** Appends a trial to the index of its stim class; its spikes follow with addSpikes() */
+	void addTrial(int trial, int stim_class);
+
+	/** Stores the spikes of (channel_idx, sorted_id) in the trial last added, offsets ascending */
+	void addSpikes(int channel_idx, int sorted_id, const float* offsets, int n_spikes);
+
+	/** Number of trials of a stim class currently kept */
+	int getNumTrials(int stim_class) const;
+
+	/** Copies out rows [first, first + count) of a stim class for one (channel_idx, sorted_id) */
+	Snapshot getRows(int channel_idx, int sorted_id, int stim_class, int first, int count) const;
+
+	/** Drops every trial. Snapshots already taken stay valid */
+	void clear();
+
+private:
+	struct Entry
+	{
+		int trial;
+		std::shared_ptr<float> chunk;
+		const float* offsets;
+		int nSpikes;
+	};
+
+	struct UnitRaster
+	{
+		std::vector<std::deque<Entry>> conditions; // by stim class, oldest first
+		std::shared_ptr<float> chunk; // being filled
+		size_t chunkUsed = 0;
+		size_t chunkCapacity = 0;
+	};
+
+	static constexpr size_t chunkSize = 1024; // spikes
+
+	mutable CriticalSection lock;
+	std::vector<std::deque<int>> conditionTrials; // trial indices kept, by stim class
+	std::vector<std::vector<UnitRaster>> units; // [channel_idx][sorted_id]
+	std::atomic<int> trialCap{ 200 };
+	int currentTrial = -1;
+	int currentStimClass = -1;
+};
+
+#endif // SPIKERASTER_H_DEFINED
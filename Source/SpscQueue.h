@@ -0,0 +1,185 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SPSCQUEUE_H_DEFINED
+#define SPSCQUEUE_H_DEFINED
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/**
+	Bounded lock-free single-producer / single-consumer ring buffer.
+
+	push() is only called from the producer thread; front(), pop() and
+	isEmpty() only from the consumer thread. Neither side ever blocks or
+	allocates: push() returns false when the queue is full.
+*/
+template <typename T>
+class SpscQueue
+{
+public:
+	/** capacity is rounded up to a power of two */
+	explicit SpscQueue(size_t capacity)
+	{
+		size_t c = 2;
+		while (c < capacity)
+		{
+			c *= 2;
+		}
+		slots.resize(c);
+		mask = c - 1;
+	}
+
+	/** Producer: copies item into the queue. Returns false if the queue is full */
+	bool push(const T& item)
+	{
+		const size_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) > mask)
+		{
+			return false;
+		}
+		slots[t & mask] = item;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	/** Consumer: returns the oldest item, or nullptr if the queue is empty */
+	T* front()
+	{
+		const size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+		{
+			return nullptr;
+		}
+		return &slots[h & mask];
+	}
+
+	/** Consumer: discards the item returned by front() */
+	void pop()
+	{
+		head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	bool isEmpty() const
+	{
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	}
+
+private:
+	std::vector<T> slots;
+	size_t mask;
+
+	/* head and tail live on separate cache lines so producer and consumer do not false-share */
+	alignas(64) std::atomic<size_t> head{ 0 };
+	alignas(64) std::atomic<size_t> tail{ 0 };
+};
+
+/**
+	Bounded lock-free single-producer / single-consumer byte ring for the
+	variable-size records that go with SpscQueue items.
+
+	The producer copies a record in with write(), or reserves room with
+	allocate() and fills it in place, and passes the returned position
+	along with its queue item; the consumer reads the record in
+	place with at() and frees it, and every record written before it, with
+	release(). A record is always contiguous: one that would straddle the
+	end of the ring starts over at the beginning.
+*/
+class SpscByteQueue
+{
+public:
+	/** capacity is rounded up to a power of two */
+	explicit SpscByteQueue(size_t capacity)
+	{
+		size_t c = 2;
+		while (c < capacity)
+		{
+			c *= 2;
+		}
+		bytes.resize(c);
+		mask = c - 1;
+	}
+
+	/** Producer: copies size bytes in. Returns their position, or -1 if there is no room */
+	int64_t write(const void* data, size_t size)
+	{
+		int64_t position = allocate(size);
+		if (position >= 0)
+		{
+			std::memcpy(at(position), data, size);
+		}
+		return position;
+	}
+
+	/** Producer: reserves size contiguous bytes, to be written through at() before the
+		queue item is pushed. Returns their position, or -1 if there is no room.
+		Records whose sizes are all multiples of 8 start 8-byte aligned */
+	int64_t allocate(size_t size)
+	{
+		if (size > bytes.size())
+		{
+			return -1;
+		}
+		size_t position = writePosition;
+		if ((position & mask) + size > bytes.size())
+		{
+			position += bytes.size() - (position & mask);
+		}
+		if (position + size - readPosition.load(std::memory_order_acquire) > bytes.size())
+		{
+			return -1;
+		}
+		writePosition = position + size;
+		return int64_t(position);
+	}
+
+	/** Producer: the room reserved at a position returned by allocate() */
+	char* at(int64_t position)
+	{
+		return &bytes[size_t(position) & mask];
+	}
+
+	/** Consumer: the record at a position returned by write() or allocate() */
+	const char* at(int64_t position) const
+	{
+		return &bytes[size_t(position) & mask];
+	}
+
+	/** Consumer: frees the size-byte record at position and every record before it */
+	void release(int64_t position, size_t size)
+	{
+		readPosition.store(size_t(position) + size, std::memory_order_release);
+	}
+
+private:
+	std::vector<char> bytes;
+	size_t mask;
+
+	size_t writePosition = 0; // producer only
+	alignas(64) std::atomic<size_t> readPosition{ 0 };
+};
+
+#endif // SPSCQUEUE_H_DEFINED
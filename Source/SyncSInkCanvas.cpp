@@ -25,32 +25,65 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "SyncSink.h"
 
+#include <cmath>
+
 
 SyncSinkCanvas::SyncSinkCanvas(SyncSink* processor_)
-	: processor(processor_)
+	: redrawTimer(*this), processor(processor_)
 {
 	processor->setCanvas(this);
-	viewport = new Viewport();
+	viewport = new PlotViewport();
 	display = new SyncSinkDisplay(processor, this, viewport);
+	viewport->display = display;
 	viewport->setViewedComponent(display, false);
-	viewport->setScrollBarsShown(true, true);
+	viewport->setScrollBarsShown(true, false);
 	addAndMakeVisible(viewport);
+	legendViewport = new Viewport();
+	legend = new SyncSinkLegend(processor, this);
+	legendViewport->setViewedComponent(legend, false);
+	legendViewport->setScrollBarsShown(true, false);
+	addAndMakeVisible(legendViewport);
+	heatmap = new PopulationHeatmap(processor);
+	addChildComponent(heatmap);
 	setWantsKeyboardFocus(true);
 
 	update();
+	redrawTimer.startTimerHz(frameRate);
 }
 
 
 SyncSinkCanvas::~SyncSinkCanvas()
 {
-
+	redrawTimer.stopTimer();
 }
 
 
 void SyncSinkCanvas::resized()
 {
-	viewport->setBounds(0, 0, getWidth(), getHeight());
-	display->setBounds(0, 0, getWidth() * 9 / 10, getHeight());
+	int legendX = getWidth() * 9 / 10;
+	viewport->setBounds(0, 0, legendX, getHeight());
+	heatmap->setBounds(0, 0, legendX, getHeight());
+	display->updateLayout();
+	legendViewport->setBounds(legendX, 0, getWidth() - legendX, getHeight() * 4 / 5);
+	legend->updateLayout(legendViewport->getWidth() - legendViewport->getScrollBarThickness());
+}
+
+void SyncSinkCanvas::PlotViewport::visibleAreaChanged(const Rectangle<int>& area)
+{
+	if (display != nullptr)
+	{
+		display->layoutVisible();
+	}
+}
+
+Colour SyncSinkCanvas::getClassColour(int stim_class) const
+{
+	if (stim_class >= 0 && stim_class < colorList.size())
+	{
+		return colorList[stim_class];
+	}
+	float hue = std::fmod(stim_class * 0.618034f, 1.0f);
+	return Colour::fromHSV(hue, 0.7f, 0.85f, 1.0f);
 }
 
 void SyncSinkCanvas::refreshState()
@@ -61,9 +94,12 @@ void SyncSinkCanvas::refreshState()
 
 void SyncSinkCanvas::update()
 {
+	updateView();
 	repaint();
-	display->resized();
+	display->updateLayout();
 	display->repaint();
+	legend->updateLayout(legendViewport->getWidth() - legendViewport->getScrollBarThickness());
+	legend->repaint();
 }
 
 
@@ -77,18 +113,64 @@ void SyncSinkCanvas::paint(Graphics& g)
 {
 
 	g.fillAll(Colours::darkgrey);
-	for (int i = 0; i < processor->numConditions; i++)
-	{
-		g.setColour(colorList[i % colorList.size()]);
-		g.fillRect(getWidth() * 9 / 10 + 10, i * 20 + 7.5, 20, 5);
-		g.setColour(Colours::white);
-		g.drawText(String(i) + String(": ") + processor->getStimClassLabel(i),
-			getWidth() * 9 / 10 + 30, i * 20, 100, 20, juce::Justification::centred, true);
-	}
+	g.setColour(Colours::white);
 	g.drawText(String("Trial: ") + String(processor->getNTrial()),
 		getWidth() * 9 / 10, getHeight() * 4 / 5, 100, 20, juce::Justification::centred, true);
 }
 
+void SyncSinkCanvas::redrawChanges()
+{
+	int changes = processor->takeCanvasChanges();
+	if (changes & SyncSink::LAYOUT_CHANGED)
+	{
+		update();
+		return;
+	}
+	if (changes & SyncSink::PLOTS_CHANGED)
+	{
+		if (heatmap->isVisible())
+		{
+			if (heatmap->refresh())
+			{
+				heatmap->repaint();
+			}
+		}
+		else
+		{
+			display->updatePlots();
+		}
+	}
+	if (changes & (SyncSink::PLOTS_CHANGED | SyncSink::LEGEND_CHANGED))
+	{
+		int legendX = getWidth() * 9 / 10;
+		repaint(legendX, 0, getWidth() - legendX, getHeight());
+	}
+}
+
+void SyncSinkCanvas::updateView()
+{
+	/* "view": PSTH grid, heatmap of units for the "select" stim class,
+	   heatmap of stim classes for the "select" channel,unit, or the grid
+	   drawn as spike rasters */
+	int view = (int)processor->getParameter("view")->getValue();
+	StringArray tokens;
+	tokens.addTokens(processor->getParameter("select")->getValueAsString(), ",", "");
+	if (view == 1)
+	{
+		heatmap->setSelection(PopulationHeatmap::UNITS, tokens[0].getIntValue(), 0, 0);
+	}
+	else if (view == 2)
+	{
+		heatmap->setSelection(PopulationHeatmap::CONDITIONS, 0, tokens[0].getIntValue(), tokens[1].getIntValue());
+	}
+	else
+	{
+		display->setRaster(view == 3);
+	}
+	viewport->setVisible(view == 0 || view == 3);
+	heatmap->setVisible(view == 1 || view == 2);
+}
+
 void SyncSinkCanvas::updatePlots()
 {
 	display->updatePlots();
@@ -119,15 +201,75 @@ void SyncSinkDisplay::paint(Graphics& g)
 
 void SyncSinkDisplay::resized()
 {
-	setBounds(0, 0, getWidth(), getHeight());
-	if (plots.size() > 0)
+	layoutVisible();
+}
+
+void SyncSinkDisplay::updateLayout()
+{
+	int width = viewport->getWidth() - viewport->getScrollBarThickness();
+	rowHeight = jmax(minRowHeight, viewport->getHeight() / 2);
+	int rows = (int(specs.size()) + columns - 1) / columns;
+	setSize(jmax(0, width), jmax(viewport->getHeight(), rows * rowHeight));
+	layoutVisible();
+}
+
+void SyncSinkDisplay::layoutVisible()
+{
+	Rectangle<int> view = viewport->getViewArea();
+	int cellWidth = getWidth() / columns;
+	int first = jmax(0, view.getY() / rowHeight) * columns;
+	int end = jmin(int(specs.size()), (view.getBottom() + rowHeight - 1) / rowHeight * columns);
+
+	/* keep plots already showing a visible cell, free the rest */
+	std::vector<PSTHPlot*> cells(jmax(0, end - first), nullptr);
+	std::vector<PSTHPlot*> free;
+	for (PSTHPlot* plot : plots)
 	{
-		for (PSTHPlot* plot : plots) {
-			int w_i = plot->identifier % 4;
-			int h_i = plot->identifier / 4;
-			plot->setBounds(w_i * getWidth() / 4, h_i * getHeight() / 2, getWidth() / 4, getHeight() / 2);
+		if (plot->identifier >= first && plot->identifier < end && cells[plot->identifier - first] == nullptr)
+		{
+			cells[plot->identifier - first] = plot;
+		}
+		else
+		{
+			plot->identifier = -1;
+			plot->setVisible(false);
+			free.push_back(plot);
 		}
 	}
+
+	for (int i = first; i < end; i++)
+	{
+		PSTHPlot*& plot = cells[i - first];
+		if (plot == nullptr)
+		{
+			if (free.empty())
+			{
+				plot = new PSTHPlot(processor, canvas, this, 0, 0, std::vector<int>(), -1);
+				addChildComponent(plot);
+				plots.add(plot);
+			}
+			else
+			{
+				plot = free.back();
+				free.pop_back();
+			}
+			plot->identifier = i;
+		}
+		const PlotSpec& spec = specs[i];
+		plot->setPlot(spec.channel_idx, spec.sorted_id, spec.stimClasses);
+		plot->setRaster(raster);
+		plot->setBounds((i % columns) * cellWidth, (i / columns) * rowHeight, cellWidth, rowHeight);
+		plot->setVisible(true);
+	}
+}
+
+void SyncSinkDisplay::setRaster(bool raster_)
+{
+	raster = raster_;
+	for (PSTHPlot* plot : plots)
+	{
+		plot->setRaster(raster);
+	}
 }
 
 void SyncSinkDisplay::removePlots()
@@ -141,8 +283,9 @@ void SyncSinkDisplay::clear()
 void SyncSinkDisplay::updatePlots()
 {
 	for (PSTHPlot* plot : plots) {
-		//std::cout << "updating plot" << std::endl;
-		plot->repaint();
+		if (plot->identifier >= 0 && plot->isStale()) {
+			plot->repaint();
+		}
 	}
 }
 
@@ -157,12 +300,189 @@ void SyncSinkDisplay::addPSTHPlot(int channel_idx, int sorted_id, std::vector<in
 		std::cout << stim_class << " ";
 	}
 	std::cout << std::endl;
-	PSTHPlot* plot = new PSTHPlot(processor, canvas, this, channel_idx, sorted_id, stimClasses, (plotCounter++) % 8);
-	addAndMakeVisible(plot);
-	plots.add(plot);
-	while (plots.size() > 8) {
-		plots[0]->clearPlot();
-		plots.remove(0);
+	for (PlotSpec& spec : specs)
+	{
+		if (spec.channel_idx == channel_idx && spec.sorted_id == sorted_id)
+		{
+			spec.stimClasses = stimClasses;
+			layoutVisible();
+			return;
+		}
+	}
+	specs.push_back({ channel_idx, sorted_id, stimClasses });
+	updateLayout();
+}
+
+PopulationHeatmap::PopulationHeatmap(SyncSink* s) :
+	processor(s)
+{
+}
+
+void PopulationHeatmap::setSelection(Mode mode_, int stim_class, int channel_idx, int sorted_id)
+{
+	if (mode_ == mode && stim_class == stimClass && channel_idx == channelIdx && sorted_id == sortedId)
+	{
+		return;
+	}
+	mode = mode_;
+	stimClass = stim_class;
+	channelIdx = channel_idx;
+	sortedId = sorted_id;
+	rowExtent = -1; // rebuild on the next refresh
+	repaint();
+}
+
+const std::vector<uint32>& PopulationHeatmap::getColourMap()
+{
+	static const std::vector<uint32> colours = []()
+	{
+		/* viridis, interpolated between five stops */
+		const Colour stops[] = {
+			Colour(68, 1, 84), Colour(59, 82, 139), Colour(33, 145, 140),
+			Colour(94, 201, 98), Colour(253, 231, 37) };
+		std::vector<uint32> c(256);
+		for (int i = 0; i < 256; i++)
+		{
+			float x = i / 255.0f * 4;
+			int stop = jmin(3, int(x));
+			c[i] = stops[stop].interpolatedWith(stops[stop + 1], x - stop).getPixelARGB().getNativeARGB();
+		}
+		return c;
+	}();
+	return colours;
+}
+
+bool PopulationHeatmap::refresh()
+{
+	const PSTHTensor& tensor = processor->getSpikeTensor();
+	PSTHTensor::ReadScope read(tensor);
+	bool changed;
+	std::vector<uint32> versions;
+	do
+	{
+		changed = false;
+		int extent = mode == UNITS ? tensor.getNumChannels() * tensor.getNumUnits() : tensor.getNumConditions();
+		int nBins = tensor.getBinning().getRowLength();
+		if (extent != rowExtent || nBins != image.getWidth())
+		{
+			rows.clear();
+			if (mode == UNITS)
+			{
+				for (int ch = 0; ch < tensor.getNumChannels(); ch++)
+				{
+					for (int un = 0; un < tensor.getNumUnits(); un++)
+					{
+						rows.push_back({ ch, un, stimClass });
+					}
+				}
+			}
+			else
+			{
+				for (int cond = 0; cond < tensor.getNumConditions(); cond++)
+				{
+					rows.push_back({ channelIdx, sortedId, cond });
+				}
+			}
+			rowVersions.assign(rows.size(), ~0u); // nothing rendered yet
+			image = rows.empty() || nBins <= 0 ? Image() : Image(Image::ARGB, nBins, int(rows.size()), true);
+			rowExtent = extent;
+			changed = true;
+		}
+		versions = rowVersions;
+		if (rows.empty() || nBins <= 0)
+		{
+			continue;
+		}
+		Image::BitmapData pixels(image, Image::BitmapData::writeOnly);
+		for (int r = 0; r < rows.size(); r++)
+		{
+			PSTHTensor::HistogramView view = tensor.getView(rows[r].channel_idx, rows[r].sorted_id, rows[r].stim_class);
+			if (view.version != versions[r])
+			{
+				renderRow(r, view, pixels);
+				versions[r] = view.version;
+				preBins = view.preBins;
+				changed = true;
+			}
+		}
+	} while (read.retry());
+	rowVersions = versions;
+	return changed;
+}
+
+void PopulationHeatmap::renderRow(int row, const PSTHTensor::HistogramView& view, Image::BitmapData& pixels)
+{
+	int nBins = jmin(view.nBins, image.getWidth());
+	rates.resize(nBins);
+	float peak = 0;
+	for (int i = 0; i < nBins; i++)
+	{
+		rates[i] = float(view.getRate(i));
+		peak = jmax(peak, rates[i]);
+	}
+
+	/* rate -> colour index -> pixel, over contiguous arrays */
+	const uint32* colours = getColourMap().data();
+	float scale = peak > 0 ? 255.0f / peak : 0.0f;
+	uint32* line = reinterpret_cast<uint32*>(pixels.getLinePointer(row));
+	for (int i = 0; i < nBins; i++)
+	{
+		line[i] = colours[int(rates[i] * scale)];
+	}
+}
+
+void PopulationHeatmap::paint(Graphics& g)
+{
+	g.fillAll(Colours::black);
+	refresh();
+	int h = getHeight() - 20;
+	if (!rows.empty() && image.getWidth() > 0)
+	{
+		g.setImageResamplingQuality(Graphics::lowResamplingQuality);
+		g.drawImage(image, 0, 0, getWidth(), h, 0, 0, image.getWidth(), image.getHeight());
+		if (preBins > 0)
+		{
+			float x = preBins * getWidth() / float(image.getWidth());
+			g.setColour(Colours::white); // stimulus onset
+			g.drawLine(x, 0, x, h, 1);
+		}
+	}
+	g.setColour(Colours::white);
+	String label = mode == UNITS
+		? String::formatted("Units x time, stim class %d: ", stimClass) + processor->getStimClassLabel(stimClass)
+		: String::formatted("Stim classes x time, chan-%d unit-%d", channelIdx, sortedId);
+	g.drawText(label, 10, h, getWidth() - 20, 20, Justification::left, true);
+}
+
+SyncSinkLegend::SyncSinkLegend(SyncSink* s, SyncSinkCanvas* c) :
+	processor(s), canvas(c)
+{
+}
+
+void SyncSinkLegend::updateLayout(int width)
+{
+	std::shared_ptr<const ConditionNames> names = processor->getConditionNames();
+	setSize(jmax(0, width), (names != nullptr ? names->size() : 0) * rowHeight);
+}
+
+void SyncSinkLegend::paint(Graphics& g)
+{
+	g.fillAll(Colours::darkgrey);
+	std::shared_ptr<const ConditionNames> names = processor->getConditionNames();
+	if (names == nullptr)
+	{
+		return;
+	}
+	Rectangle<int> clip = g.getClipBounds();
+	int first = jmax(0, clip.getY() / rowHeight);
+	int end = jmin(names->size(), clip.getBottom() / rowHeight + 1);
+	for (int i = first; i < end; i++)
+	{
+		g.setColour(canvas->getClassColour(i));
+		g.fillRect(10.0f, i * rowHeight + 7.5f, 20.0f, 5.0f);
+		g.setColour(Colours::white);
+		g.drawText(String(i) + String(": ") + names->getLabel(i),
+			30, i * rowHeight, getWidth() - 30, rowHeight, juce::Justification::centredLeft, true);
 	}
 }
 
@@ -177,52 +497,246 @@ PSTHPlot::PSTHPlot(SyncSink* s, SyncSinkCanvas* c, SyncSinkDisplay* d,
 	identifier(identifier)
 {
 	font = Font("Default", 15, Font::plain);
-	int w_i = identifier % 4;
-	int h_i = identifier / 4;
-	setBounds(w_i * d->getWidth() / 4, h_i * d->getHeight() / 2, d->getWidth() / 4, d->getHeight() / 2);
 	alive = true;
 }
 PSTHPlot::~PSTHPlot()
 {
 }
 
+void PSTHPlot::setPlot(int channel_idx_, int sorted_id_, const std::vector<int>& stim_classes)
+{
+	if (channel_idx_ == channel_idx && sorted_id_ == sorted_id && stim_classes == stimClasses)
+	{
+		return;
+	}
+	channel_idx = channel_idx_;
+	sorted_id = sorted_id_;
+	stimClasses = stim_classes;
+	histograms.clear();
+	errors.clear();
+	histogramVersions.clear();
+	paths.clear();
+	bands.clear();
+	maxRates.clear();
+	pathsValid.clear();
+	repaint();
+}
+
+void PSTHPlot::setRaster(bool raster_)
+{
+	if (raster != raster_)
+	{
+		raster = raster_;
+		repaint();
+	}
+}
+
+bool PSTHPlot::isStale() const
+{
+	if (!alive || processor == nullptr)
+	{
+		return false;
+	}
+	if (histogramVersions.size() != stimClasses.size())
+	{
+		return true;
+	}
+	const PSTHTensor& tensor = processor->getSpikeTensor();
+	PSTHTensor::ReadScope read(tensor);
+	bool stale;
+	do
+	{
+		stale = false;
+		for (int i = 0; i < stimClasses.size() && !stale; i++)
+		{
+			stale = tensor.getView(channel_idx, sorted_id, stimClasses[i]).version != histogramVersions[i];
+		}
+	} while (read.retry());
+	return stale;
+}
+
+void PSTHPlot::refreshHistograms()
+{
+	histograms.resize(stimClasses.size());
+	errors.resize(stimClasses.size());
+	histogramVersions.resize(stimClasses.size(), 0);
+	paths.resize(stimClasses.size());
+	bands.resize(stimClasses.size());
+	maxRates.resize(stimClasses.size(), 0);
+	pathsValid.resize(stimClasses.size(), false);
+
+	const PSTHTensor& tensor = processor->getSpikeTensor();
+	PSTHTensor::ReadScope read(tensor);
+	std::vector<uint32> versions(histogramVersions);
+	do
+	{
+		versions = histogramVersions;
+		for (int i = 0; i < stimClasses.size(); i++)
+		{
+			PSTHTensor::HistogramView view = tensor.getView(channel_idx, sorted_id, stimClasses[i]);
+			if (view.version == histogramVersions[i])
+			{
+				continue; // nothing changed since the last paint
+			}
+			histograms[i].resize(view.nBins);
+			errors[i].resize(view.nBins);
+			pathsValid[i] = false;
+			preBins = view.preBins;
+			binSize = view.binSize;
+			for (int bin = 0; bin < view.nBins; bin++)
+			{
+				histograms[i][bin] = view.getRate(bin);
+				errors[i][bin] = view.getRateSEM(bin);
+			}
+			versions[i] = view.version;
+		}
+	} while (read.retry());
+	histogramVersions = versions;
+}
+
+void PSTHPlot::rebuildPath(int c, int width)
+{
+	const std::vector<double>& histogram = histograms[c];
+	Path& path = paths[c];
+	path.clear();
+	int nBins = histogram.size();
+	maxRates[c] = nBins > 0 ? *std::max_element(histogram.begin(), histogram.end()) : 0;
+	pathsValid[c] = true;
+	if (nBins < 2)
+	{
+		bands[c].clear();
+		return;
+	}
+	rebuildBand(c, width);
+	path.startNewSubPath(0, float(histogram[0]));
+	if (nBins <= width)
+	{
+		for (int i = 1; i < nBins; i++)
+		{
+			path.lineTo(float(i), float(histogram[i]));
+		}
+		return;
+	}
+
+	/* more bins than pixels: one vertical stroke per pixel column from its
+	   min to its max (in the order they occur), so no peak is lost */
+	float dx = width / float(nBins - 1);
+	int i = 0;
+	while (i < nBins)
+	{
+		int column = int(i * dx);
+		int first = i;
+		int lo = i;
+		int hi = i;
+		for (i++; i < nBins && int(i * dx) == column; i++)
+		{
+			if (histogram[i] < histogram[lo]) lo = i;
+			if (histogram[i] > histogram[hi]) hi = i;
+		}
+		float x = float(first);
+		path.lineTo(x, float(histogram[jmin(lo, hi)]));
+		path.lineTo(x, float(histogram[jmax(lo, hi)]));
+	}
+}
+
+void PSTHPlot::rebuildBand(int c, int width)
+{
+	const std::vector<double>& histogram = histograms[c];
+	const std::vector<double>& error = errors[c];
+	Path& band = bands[c];
+	band.clear();
+	int nBins = histogram.size();
+	if (std::all_of(error.begin(), error.end(), [](double e) { return e == 0; }))
+	{
+		return;
+	}
+
+	/* the envelope of mean +/- SEM over the same pixel columns as the line */
+	std::vector<float> xs, upper, lower;
+	float dx = width / float(nBins - 1);
+	bool decimate = nBins > width;
+	int i = 0;
+	while (i < nBins)
+	{
+		int column = int(i * dx);
+		xs.push_back(float(i));
+		double hi = histogram[i] + error[i];
+		double lo = histogram[i] - error[i];
+		for (i++; decimate && i < nBins && int(i * dx) == column; i++)
+		{
+			hi = jmax(hi, histogram[i] + error[i]);
+			lo = jmin(lo, histogram[i] - error[i]);
+		}
+		upper.push_back(float(hi));
+		lower.push_back(float(jmax(0.0, lo)));
+		maxRates[c] = jmax(maxRates[c], hi);
+	}
+	band.startNewSubPath(xs[0], upper[0]);
+	for (int k = 1; k < xs.size(); k++)
+	{
+		band.lineTo(xs[k], upper[k]);
+	}
+	for (int k = int(xs.size()) - 1; k >= 0; k--)
+	{
+		band.lineTo(xs[k], lower[k]);
+	}
+	band.closeSubPath();
+}
+
 void PSTHPlot::paint(Graphics& g)
 {
 	if (alive)
 	{
-		int nBins = processor->getNBins();
 		g.fillAll(Colours::white);
 		//std::cout << "psth paint " << identifier << std::endl;
 		g.drawRect(0, 0, getWidth(), getHeight());
 		g.setFont(font);
 		g.drawText(String::formatted("PSTH chan-%d unit-%d", channel_idx, sorted_id), 10, getHeight() - 20, 200, 20, Justification::left, false);
-		if (processor)
+		if (processor && raster)
+		{
+			refreshHistograms(); // keeps isStale() quiet until the next trial
+			paintRaster(g);
+		}
+		else if (processor)
 		{
+			refreshHistograms();
+			int width = getWidth();
 			double max_y_all_classes = 0;
-			for (int stim_class : stimClasses)
+			for (int c = 0; c < stimClasses.size(); c++)
+			{
+				if (!pathsValid[c] || width != pathWidth)
+				{
+					rebuildPath(c, width);
+				}
+				if (histograms[c].size() > 1)
+				{
+					max_y_all_classes = jmax(max_y_all_classes, maxRates[c]);
+				}
+			}
+			pathWidth = width;
+
+			float h = getHeight();
+			for (int c = 0; c < stimClasses.size(); c++)
 			{
-				std::vector<double> histogram = processor->getHistogram(channel_idx, sorted_id, stim_class);
-				if (histogram.size() >= nBins) {
+				int nBins = histograms[c].size();
+				if (nBins > 1) {
 					//g.drawText(String(processor->getNTrial()), getLocalBounds(), juce::Justification::centred, true);
-					g.setColour(canvas->colorList[stim_class]); // different colors
-					float dx = getWidth() / float(nBins - 1);
-					float h = getHeight();
-					float x = 0.0f;
-					double max_y = *std::max_element(histogram.begin(), histogram.end());
-					if (max_y >= max_y_all_classes)
+					float dx = width / float(nBins - 1);
+					if (preBins > 0)
 					{
-						max_y_all_classes = max_y;
+						g.setColour(Colours::lightgrey); // stimulus onset
+						g.drawLine(preBins * dx, 0, preBins * dx, h, 1);
 					}
-					//           std::cout << max_y << std::endl;
-					for (int i = 0; i < nBins - 1; i++)
+					Colour colour = canvas->getClassColour(stimClasses[c]); // different colors
+					float yScale = max_y_all_classes == 0 ? 1 : float(h / max_y_all_classes);
+					AffineTransform toPixels = AffineTransform::scale(dx, -yScale).translated(0, h);
+					if (!bands[c].isEmpty())
 					{
-						float y1 = max_y_all_classes == 0 ? 0 : float(histogram[i]) / max_y_all_classes * h;
-						float y2 = max_y_all_classes == 0 ? 0 : float(histogram[i + 1]) / max_y_all_classes * h;
-						//                std::cout << y1 << " ";
-						g.drawLine(x, h - y1, x + dx, h - y2, 2);
-						x += dx;
+						g.setColour(colour.withAlpha(0.25f));
+						g.fillPath(bands[c], toPixels);
 					}
-					//            std::cout << std::endl;
+					g.setColour(colour);
+					g.strokePath(paths[c], PathStrokeType(2), toPixels);
 				}
 			}
 		}
@@ -234,6 +748,59 @@ void PSTHPlot::paint(Graphics& g)
 	}
 }
 
+void PSTHPlot::paintRaster(Graphics& g)
+{
+	int nClasses = stimClasses.size();
+	if (nClasses == 0 || histograms.empty() || binSize <= 0)
+	{
+		return;
+	}
+	float width = getWidth();
+	float top = 2;
+	float bandHeight = (getHeight() - 20 - top) / float(nClasses); // above the label
+	float start = -preBins * float(binSize); // ms at the left edge
+	float span = histograms[0].size() * float(binSize);
+	if (bandHeight < 1 || span <= 0)
+	{
+		return;
+	}
+	if (preBins > 0)
+	{
+		g.setColour(Colours::lightgrey); // stimulus onset
+		g.drawLine(-start / span * width, 0, -start / span * width, getHeight() - 20.0f, 1);
+	}
+
+	/* most recent trials at the bottom of each band, at least a pixel per trial */
+	const SpikeRaster& spikeRaster = processor->getSpikeRaster();
+	for (int c = 0; c < nClasses; c++)
+	{
+		int nTrials = spikeRaster.getNumTrials(stimClasses[c]);
+		int rows = jmin(nTrials, int(bandHeight));
+		if (rows == 0)
+		{
+			continue;
+		}
+		SpikeRaster::Snapshot snapshot = spikeRaster.getRows(channel_idx, sorted_id, stimClasses[c], nTrials - rows, rows);
+		float rowHeight = bandHeight / rows;
+		float tick = rowHeight > 3 ? rowHeight - 1 : rowHeight;
+		float bandTop = top + c * bandHeight;
+		g.setColour(canvas->getClassColour(stimClasses[c]));
+		for (int r = 0; r < snapshot.rows.size(); r++)
+		{
+			const SpikeRaster::Row& row = snapshot.rows[r];
+			float y = bandTop + r * rowHeight;
+			for (int i = 0; i < row.nSpikes; i++)
+			{
+				float x = (row.offsets[i] - start) / span * width;
+				if (x >= 0 && x < width)
+				{
+					g.fillRect(x, y, 1.0f, tick);
+				}
+			}
+		}
+	}
+}
+
 void PSTHPlot::resized()
 {
 	repaint();
@@ -26,6 +26,8 @@
 #include "SyncSinkCanvas.h"
 #include <zmq.h>
 
+#include <numeric>
+
 SyncSink::SyncSink() 
     : GenericProcessor("SyncSink2"), Thread("SyncSinkNetworkThread")
 {
@@ -45,15 +47,66 @@ SyncSink::SyncSink()
         "binsize",
         "Size of a bin in ms",
         "10");
+    addStringParameter(Parameter::GLOBAL_SCOPE,
+        "prewindow",
+        "Pre-stimulus window in ms",
+        "0");
+    addStringParameter(Parameter::GLOBAL_SCOPE,
+        "resolution",
+        "Base bin size in ms; rebinning to a multiple of it is instant",
+        "1");
+    addCategoricalParameter(Parameter::GLOBAL_SCOPE,
+        "alignment",
+        "Clock used to align spikes to TrialAlign",
+        { "software", "sample" },
+        0);
+    addCategoricalParameter(Parameter::GLOBAL_SCOPE,
+        "transport",
+        "ZMQ socket type for trial events: REP (replies to every message), PULL or SUB",
+        { "REP", "PULL", "SUB" },
+        TRANSPORT_REP);
+    addCategoricalParameter(Parameter::GLOBAL_SCOPE,
+        "view",
+        "Canvas view: PSTH plots, units x time for a stim class, stim classes x time for a unit, or spike rasters",
+        { "PSTH", "Units", "Conditions", "Raster" },
+        0);
+    addStringParameter(Parameter::GLOBAL_SCOPE,
+        "select",
+        "Heatmap selection: stim class (Units) or channel,unit (Conditions)",
+        "0");
+    addStringParameter(Parameter::GLOBAL_SCOPE,
+        "endpoint",
+        "ZMQ endpoint to bind, e.g. tcp://*:5557 or ipc:///tmp/syncsink",
+        "tcp://*:5557");
+    addStringParameter(Parameter::GLOBAL_SCOPE,
+        "rastertrials",
+        "Trials of each stim class kept per unit for the raster view",
+        "200");
+    addStringParameter(Parameter::GLOBAL_SCOPE,
+        "binthreads",
+        "Worker threads binning committed trials, sharded by spike channel; 0 bins on the engine thread",
+        "0");
+    addStringParameter(Parameter::GLOBAL_SCOPE,
+        "publish",
+        "ZMQ endpoint to publish the changed PSTHs on after every TrialEnd, e.g. tcp://*:5558; empty to disable",
+        "");
 	context = zmq_ctx_new();
-	//socket = zmq_socket(context, ZMQ_SUB);
-	socket = zmq_socket(context, ZMQ_REP);
-	dataport = 5557;
-	//zmq_setsockopt(socket, ZMQ_SUBSCRIBE, "", 0);
-	const int RECV_TIMEOUT = 10;
-	zmq_setsockopt(socket, ZMQ_RCVTIMEO, &RECV_TIMEOUT, sizeof(RECV_TIMEOUT));
-	int rc = zmq_bind(socket, "tcp://*:5557");
-	std::cout << "SyncSink(): syncsink listening on port 5557 " << rc << " " << zmq_errno() << std::endl;
+	publisher = std::make_unique<HistogramPublisher>(context);
+
+	/* tensors projected past a quarter of the RAM are backed by a file */
+	TensorBuffer::Policy storage;
+	storage.mappedThreshold = size_t(SystemStats::getMemorySizeInMegabytes()) << 18;
+	storage.directory = getSnapshotDirectory();
+	spikeTensor.setStoragePolicy(storage);
+	rebinner.setStoragePolicy(storage);
+	/* the trial log keeps at most an eighth of the RAM; older trials are dropped */
+	trialLog.setMaxBytes(size_t(SystemStats::getMemorySizeInMegabytes()) << 17);
+	setTensorBinning(binning);
+	trialSpikes.reserve(4096);
+	engine = std::make_unique<SyncSinkEngine>(this);
+	engine->startThread();
+	snapshotWriter.startThread();
+	publisher->startThread();
 	startThread();
 }
 
@@ -63,7 +116,9 @@ SyncSink::~SyncSink()
 	if (!stopThread(1000)) {
 		std::cerr << "Network thread timeout." << std::endl;
 	}
-	zmq_close(socket);
+	engine.reset();
+	closeSocket();
+	publisher.reset(); // its socket must be closed before the context is destroyed
 	zmq_ctx_destroy(context);
 }
 
@@ -80,9 +135,11 @@ void SyncSink::parameterValueChanged(Parameter* param)
 		StringArray tokens;
 		tokens.addTokens(param->getValueAsString(), ",", "");
 		/* tokens[0] == channel_idx; tokens[1] == sorted_id; tokens[2] == stim_class */
+		std::shared_ptr<const ConditionNames> names = getConditionNames();
 		if (tokens.size() == 3)
 		{
-			if (tokens[2].getIntValue() >= numConditions)
+			int stim_class = tokens[2].getIntValue();
+			if (names == nullptr || stim_class < 0 || stim_class >= names->size())
 			{
 				std::cout << "SyncSink::parameterValueChanged(): stim class specified out of bounds" << std::endl;
 				return;
@@ -90,12 +147,12 @@ void SyncSink::parameterValueChanged(Parameter* param)
 			addPSTHPlot(
 				tokens[0].getIntValue(),
 				tokens[1].getIntValue(),
-				std::vector<int>(1, tokens[2].getIntValue())
+				std::vector<int>(1, stim_class)
 			);
 		}
 		else if (tokens.size() == 2)
 		{
-			if (numConditions < 0)
+			if (names == nullptr)
 			{
 				std::cout << "SyncSink::parameterValueChanged(): empty stim class list" << std::endl;
 				return;
@@ -103,7 +160,7 @@ void SyncSink::parameterValueChanged(Parameter* param)
 			addPSTHPlot(
 				tokens[0].getIntValue(),
 				tokens[1].getIntValue(),
-				getStimClasses()
+				names->getStimClasses()
 			);
 		}
 		else
@@ -114,13 +171,37 @@ void SyncSink::parameterValueChanged(Parameter* param)
     else if (param->getName().equalsIgnoreCase("cluster")) {
 
     }
-    else if (param->getName().equalsIgnoreCase("nbins")) {
-		nBins = param->getValueAsString().getIntValue();
-		rebin(nBins, binSize);
+    else if (param->getName().equalsIgnoreCase("nbins")
+		|| param->getName().equalsIgnoreCase("binsize")
+		|| param->getName().equalsIgnoreCase("prewindow")
+		|| param->getName().equalsIgnoreCase("resolution")) {
+		resolution = jmax(1, getParameter("resolution")->getValueAsString().getIntValue());
+		rebin(getParameter("nbins")->getValueAsString().getIntValue(),
+			getParameter("binsize")->getValueAsString().getIntValue(),
+			getParameter("prewindow")->getValueAsString().getIntValue());
+    }
+    else if (param->getName().equalsIgnoreCase("alignment")) {
+		useSampleClock = (int)param->getValue() == 1;
+    }
+    else if (param->getName().equalsIgnoreCase("rastertrials")) {
+		spikeRaster.setTrialCap(param->getValueAsString().getIntValue());
+    }
+    else if (param->getName().equalsIgnoreCase("binthreads")) {
+		binThreads = jlimit(0, SystemStats::getNumCpus(), param->getValueAsString().getIntValue());
+    }
+    else if (param->getName().equalsIgnoreCase("view")
+		|| param->getName().equalsIgnoreCase("select")) {
+		markCanvasDirty(LAYOUT_CHANGED);
     }
-    else if (param->getName().equalsIgnoreCase("binsize")) {
-		binSize = param->getValueAsString().getIntValue();
-		rebin(nBins, binSize);
+    else if (param->getName().equalsIgnoreCase("transport")
+		|| param->getName().equalsIgnoreCase("endpoint")) {
+		const ScopedLock lock(transportLock);
+		transportMode = (int)getParameter("transport")->getValue();
+		transportEndpoint = getParameter("endpoint")->getValueAsString().trim();
+		transportChanged = true; // the network thread re-binds before its next receive
+    }
+    else if (param->getName().equalsIgnoreCase("publish")) {
+		publisher->setEndpoint(param->getValueAsString());
     }
 }
 
@@ -131,7 +212,17 @@ void SyncSink::updateSettings()
 
 void SyncSink::process(AudioBuffer<float>& buffer)
 {
+	/* anchor every stream's sample counter before its spikes are queued */
+	int64 now = CoreServices::getSoftwareTimestamp();
+	for (auto stream : getDataStreams())
+	{
+		uint16 streamId = stream->getStreamId();
+		engine->postClock(streamId,
+			getFirstSampleNumberForBlock(streamId) + getNumSamplesInBlock(streamId),
+			stream->getSampleRate(), now);
+	}
     checkForEvents(true);
+	postSpikeBatch();
 }
 
 
@@ -142,239 +233,660 @@ void SyncSink::handleTTLEvent(TTLEventPtr event)
 
 void SyncSink::handleSpike(SpikePtr event)
 {
-	int sampleNum = event->getSampleNumber();
-	double sampleRate = event->getChannelInfo()->getSampleRate();
-	double sampleTimestamp = (double) sampleNum / (sampleRate / 1000) + startTimestamp;
-	int64 timestamp = (int64)sampleTimestamp;
-	//std::cout << "SyncSink::handleSpike(): sample num " << event->getSampleNumber() << " timestamp " << timestamp << " " << std::endl;
-
-	const SpikeChannel* chan = event->getChannelInfo();
-	int64 numChannels = chan->getNumChannels();
-	int64 numSamples = chan->getTotalSamples();
-	int64 spikeChannelIdx = event->getChannelIndex();
-	int64 sortedID = event->getSortedId();
-	//std::cout << "SyncSink::handleSpike(): inTrial" << inTrial << " numConditions " << numConditions << " currentStimClass " << currentStimClass << " currentTrialStartTime " << currentTrialStartTime << std::endl;
-	if (!inTrial || numConditions < 0 || currentStimClass < 0 || currentTrialStartTime < 0)
+	/* the spike is stamped with the rest of the block in postSpikeBatch();
+	   only the first spike of a stream looks up its sample rate */
+	int streamId = event->getStreamId();
+	if (streamId >= spikeSamplesPerMs.size())
 	{
-		return; // do not process spike when stimulus is not presented
+		spikeSamplesPerMs.resize(streamId + 1, 0);
+	}
+	if (spikeSamplesPerMs[streamId] <= 0)
+	{
+		spikeSamplesPerMs[streamId] = event->getChannelInfo()->getSampleRate() / 1000;
+	}
+	spikeBatch.add(event->getChannelIndex(), event->getSortedId(), streamId, event->getSampleNumber());
+	if (spikeBatch.isFull())
+	{
+		postSpikeBatch();
+	}
+}
+
+
+void SyncSink::postSpikeBatch()
+{
+	spikeBatch.stamp(spikeSamplesPerMs, startTimestamp);
+	engine->postSpikes(spikeBatch);
+	spikeBatch.clear();
+}
+
+
+void SyncSink::updateStreamClock(int stream_id, int64 sample_number, double sample_rate, int64 timestamp)
+{
+	if (stream_id >= streamClocks.size())
+	{
+		streamClocks.resize(stream_id + 1);
 	}
+	StreamClock& clock = streamClocks[stream_id];
+	clock.anchorSample = sample_number;
+	clock.anchorTime = timestamp;
+	clock.sampleRate = (int64)(sample_rate + 0.5);
+}
 
-	/* Store in spikeTensor */
-//		std::cout << "spike channel idx " << String(spikeChannelIdx) << std::endl;
-	while (spikeTensor.size() < (spikeChannelIdx + 1))
+
+int64 SyncSink::getAlignSample(int stream_id)
+{
+	if (stream_id >= streamClocks.size() || streamClocks[stream_id].anchorSample < 0
+		|| streamClocks[stream_id].sampleRate <= 0)
+	{
+		return -1;
+	}
+	if (stream_id >= trialAlignSamples.size())
+	{
+		trialAlignSamples.resize(stream_id + 1, -1);
+	}
+	if (trialAlignSamples[stream_id] < 0)
 	{
-		std::vector<std::vector<std::vector<double>>> thisChannelSpikeTensor;
-		//			std::cout << "create channel tensor " << String(spikeTensor.size()) << std::endl;
-		spikeTensor.push_back(thisChannelSpikeTensor);
+		const StreamClock& clock = streamClocks[stream_id];
+		trialAlignSamples[stream_id] = clock.anchorSample
+			+ (currentTrialStartTime - clock.anchorTime) * clock.sampleRate / 1000;
 	}
+	return trialAlignSamples[stream_id];
+}
+
 
-	//		std::cout << "spike sorted id " << String(sortedID) << std::endl;
-	while (spikeTensor[spikeChannelIdx].size() < (sortedID + 1))
+std::vector<int64> SyncSink::getStreamSampleRates() const
+{
+	std::vector<int64> rates(streamClocks.size(), 0);
+	for (int i = 0; i < streamClocks.size(); i++)
 	{
-		std::vector<std::vector<double>> thisUnitSpikeTensor;
-		//			std::cout << "create unit tensor" << String(spikeTensor[spikeChannelIdx].size()) << std::endl;
-		spikeTensor[spikeChannelIdx].push_back(thisUnitSpikeTensor);
+		rates[i] = streamClocks[i].sampleRate;
 	}
+	return rates;
+}
+
 
-	while (spikeTensor[spikeChannelIdx][sortedID].size() < numConditions)
+void SyncSink::binSpikes(const SpikeBatchView& batch, int begin, int end)
+{
+	for (int i = begin; i < end; i++)
 	{
-		std::vector<double> thisConditionSpikeTensor(nBins, (double)0);
-		//			std::cout << "create condition tensor" << String(spikeTensor[spikeChannelIdx][sortedID].size()) << std::endl;
-		spikeTensor[spikeChannelIdx][sortedID].push_back(thisConditionSpikeTensor);
+		spikeHistory.add(batch.channelIdx[i], batch.sortedId[i], { batch.sampleNumber[i], batch.timestamp[i], batch.streamId[i] });
 	}
-	//		std::vector<double> thisConditionSpikeTensor = thisUnitSpikeTensor[currentStimClass];
 
-	double offset = double(timestamp - currentTrialStartTime); // milliseconds
-	int bin = floor(offset / ((double)binSize));
-	//std::cout << "SyncSink::handleSpike(): sample num " << event->getSampleNumber() << " timestamp " << timestamp << " offset " << offset << " bin " << bin << std::endl;
-	if (!nTrialsByStimClass.contains(currentStimClass))
+	if (!inTrial || numConditions < 0 || currentStimClass < 0 || currentTrialStartTime < 0)
 	{
-		std::cout << "SyncSink::handleSpike(): unregistered stim class " << currentStimClass << std::endl;
+		return; // do not process spike when stimulus is not presented
+	}
+	if (trialUsesSampleClock)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			addTrialSpike(batch.channelIdx[i], batch.sortedId[i], batch.streamId[i], batch.sampleNumber[i], batch.timestamp[i]);
+		}
 		return;
 	}
-	if (bin < nBins)
+	/* software clock: the offsets of the whole run in one pass */
+	size_t first = trialSpikes.size();
+	trialSpikes.resize(first + (end - begin));
+	TrialLog::Spike* out = trialSpikes.data() + first;
+	for (int i = begin; i < end; i++)
 	{
-		spikeTensor[spikeChannelIdx][sortedID][currentStimClass][bin] += double(1) / double(nTrialsByStimClass[currentStimClass]); // assignment not working
-//			std::cout << spikeTensor[spikeChannelIdx][sortedID][currentStimClass][bin] << " ";
+		out[i - begin] = { batch.channelIdx[i], batch.sortedId[i], batch.streamId[i], batch.timestamp[i] - currentTrialStartTime };
 	}
 }
 
 
-void SyncSink::handleBroadcastMessage(String message)
+void SyncSink::addTrialSpike(int spikeChannelIdx, int sortedID, int streamId, int64 sampleNumber, int64 timestamp)
 {
-    //std::cout << "SyncSink::handleBroadcastMessage(): received " << message << " " << CoreServices::getSoftwareTimestamp() << std::endl;
-	int64 timestamp = CoreServices::getSoftwareTimestamp();
-	/* Parse Kofiko */
-	// Beginning of trial: add conditions
-	//std::cout << text << std::endl;
-	if (message.startsWith("ClearDesign"))
+	/* Keep the spike for this trial; it is binned into spikeTensor when the trial is committed */
+	if (trialUsesSampleClock)
 	{
-		clearVars();
-		if (canvas != nullptr)
+		int64 alignSample = getAlignSample(streamId);
+		if (alignSample < 0)
 		{
-			canvas->update();
+			return; // no block seen yet for this stream
 		}
+		trialSpikes.push_back({ spikeChannelIdx, sortedID, streamId, sampleNumber - alignSample });
 	}
-	else if (message.startsWith("AddCondition"))
+	else
 	{
-		StringArray tokens;
-		tokens.addTokens(message, true);
-		/* tokens[0] == AddCondition; tokens[1] == Name; tokens[2] == STIMCLASS;
-		   tokens[3] == Visible; tokens[4] == 1; tokens[5] == TrialTypes; */
-		for (int i = 6; i < tokens.size(); i++)
+		trialSpikes.push_back({ spikeChannelIdx, sortedID, streamId, timestamp - currentTrialStartTime });
+	}
+}
+
+
+void SyncSink::commitTrial()
+{
+	if (!trialPending)
+	{
+		return;
+	}
+	if (currentStimClass >= 0 && currentStimClass < spikeTensor.getNumConditions())
+	{
+		/* the log keeps every spike of the trial, including those outside the
+		   current window, so a later rebin loses nothing; the tensor is then
+		   updated from the sorted spikes in one write section */
+		trialLog.append(currentStimClass, trialUsesSampleClock, trialSpikes);
+		std::vector<int64> sampleRates = getStreamSampleRates();
+		if (binner.getNumShards() != binThreads)
 		{
-			//std::cout << tokens[i] << std::endl;
-			conditionMap.set(tokens[i], tokens[2]);
+			binner.setNumShards(binThreads);
+		}
+		/* the bin workers fill the tensor while the raster is filled here */
+		binner.start(spikeTensor, currentStimClass, trialUsesSampleClock, trialSpikes, sampleRates);
+		addRasterTrial(trialLog.getNumTrials() - 1, sampleRates);
+		binner.finish();
+	}
+	else
+	{
+		std::cout << "SyncSink::commitTrial(): unregistered stim class " << currentStimClass << std::endl;
+	}
+	trialSpikes.clear();
+	trialPending = false;
+}
+
+void SyncSink::dropTrial()
+{
+	std::cout << "SyncSink::dropTrial(): out of memory; trial of stim class " << currentStimClass << " dropped" << std::endl;
+	trialSpikes.clear();
+	trialPending = false;
+	inTrial = false;
+	currentStimClass = -1;
+	currentTrialStartTime = -1;
+	markCanvasDirty(PLOTS_CHANGED | LEGEND_CHANGED);
+}
+
 
+void SyncSink::addRasterTrial(int trial, const std::vector<int64>& sample_rates)
+{
+	/* trialSpikes was sorted by (channel, unit, stream, offset) when it was logged */
+	spikeRaster.addTrial(trial, currentStimClass);
+	size_t i = 0;
+	while (i < trialSpikes.size())
+	{
+		const TrialLog::Spike& first = trialSpikes[i];
+		rasterOffsets.clear();
+		for (; i < trialSpikes.size() && trialSpikes[i].channelIdx == first.channelIdx
+			&& trialSpikes[i].sortedId == first.sortedId; i++)
+		{
+			const TrialLog::Spike& spike = trialSpikes[i];
+			if (!trialUsesSampleClock)
+			{
+				rasterOffsets.push_back(float(spike.offset));
+			}
+			else if (spike.streamId < sample_rates.size() && sample_rates[spike.streamId] > 0)
+			{
+				rasterOffsets.push_back(float(spike.offset * 1000.0 / sample_rates[spike.streamId]));
+			}
 		}
-		conditionList.set(tokens[2], numConditions);
-		conditionListInverse.set(numConditions, tokens[2]);
-		nTrialsByStimClass.set(numConditions, 0);
-		stimClasses.push_back(numConditions);
-		numConditions += 1;
-		if (canvas != nullptr)
+		spikeRaster.addSpikes(first.channelIdx, first.sortedId, rasterOffsets.data(), (int)rasterOffsets.size());
+	}
+}
+
+void SyncSink::handleBroadcastMessage(String message)
+{
+    //std::cout << "SyncSink::handleBroadcastMessage(): received " << message << " " << CoreServices::getSoftwareTimestamp() << std::endl;
+	engine->postBroadcastMessage(message, CoreServices::getSoftwareTimestamp());
+}
+
+
+void SyncSink::applyTrialMessage(std::string_view message, int64 timestamp)
+{
+	/* Parse Kofiko */
+	KofikoMessage tokens(message);
+	TrialEvent::Type type;
+	if (!tokens.getType(type))
+	{
+		return;
+	}
+	switch (type)
+	{
+	case TrialEvent::CLEAR_DESIGN:
+		clearDesign();
+		break;
+	case TrialEvent::ADD_CONDITION:
+		applyAddCondition(tokens);
+		break;
+	case TrialEvent::SET_DESIGN:
+	{
+		/* the rest of the message is one AddCondition per line */
+		beginDesign();
+		std::string_view rest = message.substr(jmin(message.find('\n'), message.size()));
+		std::string_view line;
+		while (KofikoMessage::nextLine(rest, line))
 		{
-			canvas->update();
+			KofikoMessage condition(line);
+			TrialEvent::Type lineType;
+			if (condition.getType(lineType) && lineType == TrialEvent::ADD_CONDITION)
+			{
+				applyAddCondition(condition);
+			}
 		}
-		//for (int stimClass : stimClasses)
-		//{
-		//	std::cout << "SyncSink::handleBroadcastMessage(): stimClass = " << stimClass << std::endl;
-		//}
-		std::cout << "SyncSink::handleBroadcastMessage(): add stimClass " << numConditions << std::endl;
+		endDesign();
+		break;
 	}
-	else if (message.startsWith("TrialStart")) // Jialiang / Berkeley Kofiko -- Sept. 2022
+	case TrialEvent::TRIAL_START:
+	case TrialEvent::TRIAL_TYPE:
 	{
-		
-		StringArray tokens;
-		tokens.addTokens(message, true);
-		/* tokens[0] == TrialStart; tokens[1] == IMGID */
-		//std::cout << "SyncSink::handleBroadcastMessage(): TrialStart " << tokens[0] << " " << tokens[1] << std::endl;
-		if (conditionMap.contains(tokens[1]))
+		/* TrialStart IMGID */
+		std::string_view image;
+		tokens.next(image);
+		int stimClass = imageIndex.find(image);
+		if (stimClass >= 0)
 		{
-			currentStimClass = conditionList[conditionMap[tokens[1]]];
-			nTrials += 1;
-			nTrialsByStimClass.set(currentStimClass, nTrialsByStimClass[currentStimClass] + 1);
+			startTrial(stimClass);
 		}
 		else
 		{
-			std::cout << "SyncSink::handleBroadcastMessage(): Image ID " << tokens[1] << " not mappable to stimulus class!" << std::endl;
+			commitTrial(); // previous trial never saw a TrialEnd
+			std::cout << "SyncSink::handleBroadcastMessage(): Image ID " << image << " not mappable to stimulus class!" << std::endl;
 		}
-		//std::cout << "SyncSink::handleBroadcastMessage(): TrialStart for image " << tokens[1] << " at " << timestamp << std::endl;
-		if (canvas != nullptr)
+		break;
+	}
+	case TrialEvent::TRIAL_ALIGN:
+		alignTrial(timestamp);
+		break;
+	case TrialEvent::TRIAL_END:
+		endTrial();
+		break;
+	}
+}
+
+void SyncSink::applyAddCondition(KofikoMessage& tokens)
+{
+	/* AddCondition Name STIMCLASS Visible 1 TrialTypes IMGID... */
+	std::string_view name;
+	tokens.skip(1);
+	tokens.next(name);
+	tokens.skip(3);
+	std::string_view image;
+	while (tokens.next(image))
+	{
+		imageIndex.add(image, numConditions);
+	}
+	addCondition(name);
+}
+
+void SyncSink::applyTrialEvent(const TrialEvent& event, std::string_view name, int64 timestamp)
+{
+	if (event.senderTime < lastSenderTime)
+	{
+		std::cout << "SyncSink::applyTrialEvent(): sender clock went back by "
+			<< lastSenderTime - event.senderTime << " us" << std::endl;
+	}
+	lastSenderTime = event.senderTime;
+
+	switch (event.type)
+	{
+	case TrialEvent::CLEAR_DESIGN:
+		clearDesign();
+		break;
+	case TrialEvent::ADD_CONDITION:
+		if (int(event.id) != numConditions)
 		{
-			canvas->updateLegend();
+			std::cout << "SyncSink::applyTrialEvent(): expected stim class " << numConditions
+				<< ", got " << int(event.id) << std::endl;
+			break;
 		}
-	}
-	else if (message.startsWith("TrialType")) // Janis Kofiko -- deprecated
+		addCondition(name);
+		break;
+	case TrialEvent::SET_DESIGN:
 	{
-		StringArray tokens;
-		tokens.addTokens(message, true);
-		//std::cout << "SyncSink::handleBroadcastMessage(): TrialType " << tokens[0] << " " << tokens[1] << std::endl;
-		/* tokens[0] == TrialAlign; tokens[1] == IMGID */
-		if (conditionMap.contains(tokens[1]))
+		if (event.id > maxConditions)
 		{
-			currentStimClass = conditionList[conditionMap[tokens[1]]];
-			nTrials += 1;
-			nTrialsByStimClass.set(currentStimClass, nTrialsByStimClass[currentStimClass] + 1);
+			std::cout << "SyncSink::applyTrialEvent(): design of " << event.id << " stim classes refused" << std::endl;
+			break;
 		}
-		else
+		beginDesign();
+		conditionNames.reserve(int(event.id));
+		std::string_view line;
+		while (numConditions < int(event.id))
 		{
-			std::cout << "SyncSink::handleBroadcastMessage(): Image ID " << tokens[1] << " not mappable to stimulus class!" << std::endl;
+			if (!KofikoMessage::nextLine(name, line))
+			{
+				line = std::string_view();
+			}
+			addCondition(line);
 		}
-		//std::cout << "SyncSink::handleBroadcastMessage(): TrialType for image " << tokens[1] << " at " << timestamp << std::endl;
-		if (canvas != nullptr)
+		endDesign();
+		break;
+	}
+	case TrialEvent::TRIAL_START:
+	case TrialEvent::TRIAL_TYPE:
+		if (int(event.id) < numConditions)
 		{
-			canvas->updateLegend();
+			startTrial(int(event.id));
 		}
+		else
+		{
+			commitTrial(); // previous trial never saw a TrialEnd
+			std::cout << "SyncSink::applyTrialEvent(): stim class " << int(event.id) << " out of bounds!" << std::endl;
+		}
+		break;
+	case TrialEvent::TRIAL_ALIGN:
+		alignTrial(timestamp);
+		break;
+	case TrialEvent::TRIAL_END:
+		endTrial();
+		break;
 	}
-	else if (message.startsWith("TrialAlign"))
+}
+
+void SyncSink::clearDesign()
+{
+	clearVars();
+	lastSenderTime = std::numeric_limits<int64>::min();
+	markCanvasDirty(LAYOUT_CHANGED);
+}
+
+void SyncSink::beginDesign()
+{
+	clearVars();
+	lastSenderTime = std::numeric_limits<int64>::min();
+	installingDesign = true;
+}
+
+void SyncSink::endDesign()
+{
+	installingDesign = false;
+	spikeTensor.setNumConditions(numConditions);
+	markCanvasDirty(LAYOUT_CHANGED);
+	std::cout << "SyncSink::endDesign(): installed " << numConditions << " stim classes, "
+		<< imageIndex.size() << " image ids" << std::endl;
+}
+
+void SyncSink::addCondition(std::string_view name)
+{
+	conditionNames.add(name);
+	conditionNamesChanged = true;
+	numConditions += 1;
+	if (installingDesign)
 	{
-		//std::cout << "SyncSink::handleBroadcastMessage(): TrialAlign at " << timestamp << std::endl;
-		currentTrialStartTime = timestamp;
-		inTrial = true;
+		return; // endDesign() sizes the tensor and notifies the canvas once
 	}
-	else if (message.startsWith("TrialEnd"))
+	spikeTensor.setNumConditions(numConditions);
+	markCanvasDirty(LAYOUT_CHANGED);
+	//for (int stimClass : stimClasses)
+	//{
+	//	std::cout << "SyncSink::handleBroadcastMessage(): stimClass = " << stimClass << std::endl;
+	//}
+	std::cout << "SyncSink::handleBroadcastMessage(): add stimClass " << numConditions << std::endl;
+}
+
+void SyncSink::startTrial(int stim_class)
+{
+	commitTrial(); // previous trial never saw a TrialEnd
+	currentStimClass = stim_class;
+	nTrials += 1;
+	trialPending = true;
+	//std::cout << "SyncSink::handleBroadcastMessage(): TrialStart for class " << stim_class << std::endl;
+	markCanvasDirty(LEGEND_CHANGED); // trial count
+}
+
+void SyncSink::alignTrial(int64 timestamp)
+{
+	//std::cout << "SyncSink::handleBroadcastMessage(): TrialAlign at " << timestamp << std::endl;
+	currentTrialStartTime = timestamp;
+	trialUsesSampleClock = useSampleClock;
+	std::fill(trialAlignSamples.begin(), trialAlignSamples.end(), -1);
+	inTrial = true;
+
+	/* spikes that arrived before this message (including the pre-stimulus
+	   window) are binned from the history; the rest arrive via binSpikes() */
+	trialSpikes.clear();
+	if (currentStimClass >= 0)
 	{
-		//std::cout << "SyncSink::handleBroadcastMessage(): TrialEnd at " << timestamp << std::endl;
-		if (canvas != nullptr) {
-			//std::cout << "send update to canvas" << std::endl;
-			canvas->updatePlots();
-			canvas->repaint();
-		}
-		//if (!nTrialsByStimClass.contains(currentStimClass))
-		//{
-		//	std::cout << "unregistered stim class " << currentStimClass << std::endl;
-		//	return;
-		//}
-		for (std::vector<std::vector<std::vector<double>>> channelTensor : spikeTensor)
-		{
-			for (std::vector<std::vector<double>> unitTensor : channelTensor)
+		spikeHistory.forEachSince(timestamp - preWindow,
+			[this](int channel_idx, int sorted_id, const SpikeHistory::Entry& spike)
 			{
+				addTrialSpike(channel_idx, sorted_id, spike.streamId, spike.sampleNumber, spike.timestamp);
+			});
+	}
+}
 
-				std::vector<double> conditionTensor = unitTensor[currentStimClass];
-				for (double val : conditionTensor)
-				{
-					val *= double(nTrialsByStimClass[currentStimClass]) / double(nTrialsByStimClass[currentStimClass] + 1);
-					//std::cout << val << " ";
-				}
-				//std::cout << std::endl;
-			}
-			//std::cout << std::endl;
-		}
-		//std::cout << std::endl;
-		currentTrialStartTime = -1;
-		currentStimClass = -1;
-		inTrial = false;
+void SyncSink::endTrial()
+{
+	//std::cout << "SyncSink::handleBroadcastMessage(): TrialEnd" << std::endl;
+	commitTrial();
+	markCanvasDirty(PLOTS_CHANGED | LEGEND_CHANGED);
+	publisher->update(spikeTensor);
+	currentTrialStartTime = -1;
+	currentStimClass = -1;
+	inTrial = false;
+
+	/* the first autosave comes an interval into the session, and none is taken
+	   while the writer still holds the last capture: a fresh one would copy every block */
+	int64 now = CoreServices::getSoftwareTimestamp();
+	if (lastAutosave < 0)
+	{
+		lastAutosave = now;
+	}
+	else if (now - lastAutosave >= autosaveInterval && tensorCapture.use_count() <= 1)
+	{
+		lastAutosave = now;
+		snapshotWriter.submit(takeSnapshot(), getAutosaveFile());
 	}
 }
 
 
 void SyncSink::saveCustomParametersToXml(XmlElement* parentElement)
 {
-
+	/* the engine copies its state between two commands and the writer saves it
+	   through a temporary file, so neither acquisition nor the GUI waits. One file
+	   per node: saved settings name the latest session of that node */
+	engine->postSnapshot();
+	parentElement->setAttribute("snapshot", getAutosaveFile().getFullPathName());
 }
 
 
 void SyncSink::loadCustomParametersFromXml(XmlElement* parentElement)
 {
+	String path = parentElement->getStringAttribute("snapshot");
+	if (path.isEmpty())
+	{
+		return;
+	}
+	auto file = std::make_unique<SessionSnapshotFile>(File(path));
+	if (!file->isValid())
+	{
+		std::cout << "SyncSink::loadCustomParametersFromXml(): no valid session snapshot at " << path << std::endl;
+		return;
+	}
+	engine->postRestore(std::move(file));
+
+	/* the restore brings the binning the file was saved with, and cancels the
+	   rebins the parameter callbacks queued before it: the parameters win, so
+	   their binning is applied again, rebinning the restored trials if needed */
+	rebin(getParameter("nbins")->getValueAsString().getIntValue(),
+		getParameter("binsize")->getValueAsString().getIntValue(),
+		getParameter("prewindow")->getValueAsString().getIntValue());
+}
+
+std::unique_ptr<SessionSnapshot> SyncSink::takeSnapshot()
+{
+	/* the capture is only refilled once the writer has let go of it; the
+	   fence pairs with the release of the writer's reference */
+	if (tensorCapture == nullptr || tensorCapture.use_count() > 1)
+	{
+		tensorCapture = std::make_shared<PSTHTensor::Capture>();
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+	spikeTensor.capture(*tensorCapture);
+
+	auto snapshot = std::make_unique<SessionSnapshot>();
+	snapshot->tensor = tensorCapture;
+	snapshot->nTrials = nTrials;
+	for (int stim_class = 0; stim_class < tensorCapture->nConditions; stim_class++)
+	{
+		snapshot->conditionNames.push_back(conditionNames.getLabel(stim_class));
+	}
+	imageIndex.forEach([&](std::string_view image_id, int stim_class)
+		{
+			snapshot->images.emplace_back(std::string(image_id), stim_class);
+		});
+	snapshot->log = trialLog.snapshot(); // shares the chunks
+	return snapshot;
+}
+
+void SyncSink::applySnapshot()
+{
+	lastAutosave = CoreServices::getSoftwareTimestamp();
+	snapshotWriter.submit(takeSnapshot(), getAutosaveFile());
+}
+
+void SyncSink::applyRestore(const SessionSnapshotFile& file)
+{
+	const SessionSnapshot::Header& header = file.getHeader();
+	beginDesign();
+	file.forEachCondition([&](const String& name)
+		{
+			addCondition(std::string_view(name.toRawUTF8(), name.getNumBytesAsUTF8()));
+		});
+	file.forEachImage([&](std::string_view image_id, int stim_class)
+		{
+			imageIndex.add(image_id, stim_class);
+		});
+	endDesign();
 
+	/* the blocks and trial records are copied straight out of the mapping */
+	spikeTensor.restore(file.getBaseBinning(), file.getDisplayBinning(),
+		header.nChannels, header.nUnits, header.nConditions,
+		file.getNumBlocks(), file.getBlockRows(), file.getSums(), file.getSquares(), file.getTrialCounts());
+	binning = spikeTensor.getBinning();
+	file.forEachTrial([&](int stim_class, bool sample_clock, const uint8* record, size_t length)
+		{
+			trialLog.appendRecord(stim_class, sample_clock, record, length);
+		});
+	nTrials = header.nTrials;
+	markCanvasDirty(PLOTS_CHANGED | LEGEND_CHANGED | LAYOUT_CHANGED);
+	std::cout << "SyncSink::applyRestore(): restored " << header.nConditions << " stim classes, "
+		<< trialLog.getNumTrials() << " trials" << std::endl;
+}
+
+File SyncSink::getSnapshotDirectory() const
+{
+	return File::getSpecialLocation(File::userApplicationDataDirectory)
+		.getChildFile("open-ephys").getChildFile("SyncSink");
+}
+
+File SyncSink::getAutosaveFile() const
+{
+	return getSnapshotDirectory().getChildFile("session-" + String(getNodeId()) + ".psth");
+}
+
+void SyncSink::openSocket()
+{
+	closeSocket();
+	int mode;
+	String endpoint;
+	{
+		const ScopedLock lock(transportLock);
+		mode = transportMode;
+		endpoint = transportEndpoint;
+	}
+	const int types[] = { ZMQ_REP, ZMQ_PULL, ZMQ_SUB };
+	socket = zmq_socket(context, types[jlimit(0, 2, mode)]);
+	socketMode = jlimit(0, 2, mode);
+	const int RECV_TIMEOUT = 10;
+	zmq_setsockopt(socket, ZMQ_RCVTIMEO, &RECV_TIMEOUT, sizeof(RECV_TIMEOUT));
+	if (socketMode == TRANSPORT_SUB)
+	{
+		zmq_setsockopt(socket, ZMQ_SUBSCRIBE, "", 0);
+	}
+	int rc = zmq_bind(socket, endpoint.toRawUTF8());
+	if (rc != 0)
+	{
+		std::cout << "SyncSink::openSocket(): unable to bind " << endpoint << ": " << zmq_strerror(zmq_errno()) << std::endl;
+		closeSocket();
+		return;
+	}
+	std::cout << "SyncSink::openSocket(): syncsink listening on " << endpoint << " ("
+		<< (socketMode == TRANSPORT_REP ? "REP" : socketMode == TRANSPORT_PULL ? "PULL" : "SUB") << ")" << std::endl;
+}
+
+void SyncSink::closeSocket()
+{
+	if (socket != nullptr)
+	{
+		const int LINGER = 0;
+		zmq_setsockopt(socket, ZMQ_LINGER, &LINGER, sizeof(LINGER));
+		zmq_close(socket);
+		socket = nullptr;
+	}
 }
 
 void SyncSink::run()
 {
-	HeapBlock<char> buf(2048);
+	/* frames are decoded in the buffer ZMQ received them into */
+	zmq_msg_t frame;
+	zmq_msg_init(&frame);
 	while (!threadShouldExit()) {
-		int res = zmq_recv(socket, buf, 2048, 0);
+		if (transportChanged.exchange(false)) {
+			openSocket();
+		}
+		if (socket == nullptr) {
+			wait(100);
+			continue;
+		}
+		int res = zmq_msg_recv(&frame, socket, 0);
 		if (res == -1) {
 			//std::cout << "SyncSink::run(): failed to receive message" << std::endl;
 			continue;
 		}
-		String msg = String::fromUTF8(buf, res);
-		handleBroadcastMessage(msg);
-		zmq_send(socket, "", 0, 0);
+		/* every frame of a multipart message is one event, queued in order
+		   with the time the batch arrived */
+		int64 timestamp = CoreServices::getSoftwareTimestamp();
+		do
+		{
+			postFrame(zmq_msg_data(&frame), zmq_msg_size(&frame), timestamp);
+		} while (zmq_msg_more(&frame) && zmq_msg_recv(&frame, socket, 0) != -1);
+		if (socketMode == TRANSPORT_REP) {
+			zmq_send(socket, "", 0, 0);
+		}
+	}
+	zmq_msg_close(&frame);
+	closeSocket();
+}
+
+void SyncSink::postFrame(const void* data, size_t size, int64 timestamp)
+{
+	if (size == 0)
+	{
+		return;
+	}
+	TrialEvent event;
+	if (TrialEvent::decode(data, size, event))
+	{
+		engine->postNetworkEvent(event, timestamp);
+	}
+	else
+	{
+		/* Kofiko text message */
+		engine->postNetworkMessage(static_cast<const char*>(data), size, timestamp);
 	}
 }
 
 bool SyncSink::startAcquisition()
 {
 	startTimestamp = CoreServices::getSoftwareTimestamp();
+	spikeSamplesPerMs.clear(); // the streams may have changed
 	std::cout << "SyncSink::startAcquisition():" << startTimestamp << std::endl;
+	droppedAtStart = engine->getNumDropped();
 	return true;
 }
 
-std::vector<double> SyncSink::getHistogram(int channel_idx, int sorted_id, int stim_class)
+bool SyncSink::stopAcquisition()
 {
-	if (channel_idx >= spikeTensor.size()) {
-		return std::vector<double>(nBins, 0);
-	}
-	if (sorted_id >= spikeTensor[channel_idx].size()) {
-		return std::vector<double>(nBins, 0);
-	}
-	if (stim_class >= spikeTensor[channel_idx][sorted_id].size())
+	int64 dropped = engine->getNumDropped() - droppedAtStart;
+	if (dropped > 0)
 	{
-		return std::vector<double>(nBins, 0);
+		std::cout << "SyncSink::stopAcquisition(): " << dropped << " spike batches or messages dropped, the engine queues were full" << std::endl;
 	}
-	return spikeTensor[channel_idx][sorted_id][stim_class];
+	return true;
+}
+
+const PSTHTensor& SyncSink::getSpikeTensor() const
+{
+	return spikeTensor;
 }
 
 int SyncSink::getNTrial()
@@ -398,7 +910,7 @@ void SyncSink::addPSTHPlot(int channel_idx, int sorted_id, std::vector<int> stim
 		std::cout << "SyncSink::addPSTHPlot(): add plot to canvas: " << channel_idx << sorted_id;
 		for (int stim_class : stimClasses)
 		{
-			std::cout << stim_class << "(" << conditionListInverse[stim_class] << ") ";
+			std::cout << stim_class << "(" << getStimClassLabel(stim_class) << ") ";
 
 		}
 		std::cout << std::endl;
@@ -408,82 +920,167 @@ void SyncSink::addPSTHPlot(int channel_idx, int sorted_id, std::vector<int> stim
 
 void SyncSink::resetTensor()
 {
-	int ch_idx = 0;
-	for (std::vector<std::vector<std::vector<double>>> channelTensor : spikeTensor)
+	engine->postReset();
+}
+
+void SyncSink::applyReset()
+{
+	rebinner.cancel();
+	trialLog.clear();
+	spikeRaster.clear();
+	setTensorBinning(binning);
+	spikeTensor.zero();
+	trialSpikes.clear();
+	trialPending = false;
+	nTrials = 0;
+	markCanvasDirty(PLOTS_CHANGED | LAYOUT_CHANGED);
+}
+
+void SyncSink::rebin(int n_bins, int bin_size, int pre_window)
+{
+	engine->postRebin(n_bins, bin_size, pre_window);
+}
+
+void SyncSink::applyRebin(int n_bins, int bin_size, int pre_window)
+{
+	if (n_bins <= 0 || bin_size <= 0)
 	{
-		int un_idx = 0;
-		for (std::vector<std::vector<double>> unitTensor : spikeTensor[ch_idx])
+		std::cout << "SyncSink::applyRebin(): invalid bin layout " << n_bins << " x " << bin_size << " ms" << std::endl;
+		return;
+	}
+	PSTHBinning requested;
+	requested.nBins = n_bins;
+	requested.binSize = bin_size;
+	preWindow = jmax(0, pre_window); // widens the retroactive window of the next trial right away
+	requested.preBins = (preWindow + bin_size - 1) / bin_size;
+
+	PSTHBinning base = getBaseBinning(requested);
+	if (trialLog.getNumTrials() == 0 || (base.binSize == spikeTensor.getBaseBinning().binSize
+		&& PSTHTensor::canDisplay(spikeTensor.getBaseBinning(), requested)))
+	{
+		/* the counts are already there at a finer resolution (or there are none yet) */
+		rebinner.cancel();
+		if (trialLog.getNumTrials() == 0)
+		{
+			setTensorBinning(requested);
+		}
+		else
 		{
-			int cond_idx = 0;
-			for (std::vector<double> conditionTensor : spikeTensor[ch_idx][un_idx])
+			spikeTensor.setDisplayBinning(requested);
+			binning = requested;
+			if (!spikeTensor.hasMoments())
 			{
-				for (int i = 0; i < spikeTensor[ch_idx][un_idx][cond_idx].size(); i++)
-				{
-					spikeTensor[ch_idx][un_idx][cond_idx][i] = 0;
-				}
-				while (spikeTensor[ch_idx][un_idx][cond_idx].size() < nBins)
-				{
-					spikeTensor[ch_idx][un_idx][cond_idx].push_back(0);
-				}
-				cond_idx++;
+				/* the means are exact already; rebuild the variances of the new bins in the background */
+				rebinner.start(trialLog.snapshot(), spikeTensor.getBaseBinning(), requested, spikeTensor.getNumConditions(), getStreamSampleRates());
 			}
-			un_idx++;
 		}
-		ch_idx++;
-	}
-	nTrials = 0;
-	if (canvas != nullptr)
-	{
-		canvas->updatePlots();
-		canvas->update();
-		canvas->updateLegend();
+		markCanvasDirty(PLOTS_CHANGED | LAYOUT_CHANGED);
+		return;
 	}
+
+	/* the live tensor keeps the old layout until the rebuilt one is ready */
+	rebinner.start(trialLog.snapshot(), base, requested, spikeTensor.getNumConditions(), getStreamSampleRates());
+}
+
+PSTHBinning SyncSink::getBaseBinning(const PSTHBinning& display) const
+{
+	PSTHBinning base;
+	base.binSize = std::gcd(display.binSize, resolution.load());
+	int factor = display.binSize / base.binSize;
+	base.nBins = display.nBins * factor;
+	base.preBins = display.preBins * factor;
+	return base;
 }
 
-void SyncSink::rebin(int n_bins, int bin_size)
+void SyncSink::setTensorBinning(const PSTHBinning& display)
 {
-	nBins = n_bins;
-	binSize = bin_size;
-	if (canvas != nullptr)
+	spikeTensor.setBinning(getBaseBinning(display));
+	spikeTensor.setDisplayBinning(display);
+	binning = display;
+}
+
+void SyncSink::finishRebin()
+{
+	rebinner.collect();
+	if (!rebinner.isDone())
+	{
+		return;
+	}
+	PSTHTensor& rebuilt = rebinner.getResult();
+	try
 	{
-		canvas->updatePlots();
-		canvas->update();
-		canvas->updateLegend();
+		rebuilt.setNumConditions(spikeTensor.getNumConditions());
+
+		/* trials committed while the job ran */
+		std::vector<int64> sampleRates = getStreamSampleRates();
+		for (int i = jmax(rebinner.getNumTrials(), trialLog.getFirstTrial()); i < trialLog.getNumTrials(); i++)
+		{
+			PSTHRebinner::accumulate(rebuilt, trialLog.getTrial(i), sampleRates);
+		}
 	}
+	catch (const std::bad_alloc&)
+	{
+		std::cout << "SyncSink::finishRebin(): out of memory; keeping " << spikeTensor.getBinning().nBins << " x "
+			<< spikeTensor.getBinning().binSize << " ms bins" << std::endl;
+		rebinner.finish();
+		return;
+	}
+	binning = rebinner.getBinning();
+	spikeTensor.adopt(rebuilt);
+	rebinner.finish();
+	std::cout << "SyncSink::finishRebin(): rebinned " << trialLog.getNumTrials() - trialLog.getFirstTrial() << " trials to "
+		<< binning.nBins << " x " << binning.binSize << " ms" << std::endl;
+
+	markCanvasDirty(PLOTS_CHANGED | LAYOUT_CHANGED);
 }
 
-String SyncSink::getStimClassLabel(int stim_class)
+void SyncSink::refreshPublisher()
 {
-	if (conditionListInverse.contains(stim_class))
+	if (publisher->isUpdateWanted())
 	{
-		return conditionListInverse[stim_class];
+		publisher->update(spikeTensor);
 	}
-	return "";
 }
 
-int SyncSink::getNBins()
+std::shared_ptr<const ConditionNames> SyncSink::getConditionNames() const
+{
+	return std::atomic_load(&publishedConditionNames);
+}
+
+void SyncSink::refreshConditionNames()
 {
-	return nBins;
+	if (!conditionNamesChanged || installingDesign)
+	{
+		return;
+	}
+	conditionNamesChanged = false;
+	std::atomic_store(&publishedConditionNames, std::shared_ptr<const ConditionNames>(std::make_shared<ConditionNames>(conditionNames)));
+	markCanvasDirty(LAYOUT_CHANGED); // the canvas may have laid out with the previous names
 }
 
-int SyncSink::getBinSize()
+String SyncSink::getStimClassLabel(int stim_class)
 {
-	return binSize;
+	std::shared_ptr<const ConditionNames> names = getConditionNames();
+	return names != nullptr ? names->getLabel(stim_class) : String();
 }
 
 std::vector<int> SyncSink::getStimClasses()
 {
-	return stimClasses;
+	std::shared_ptr<const ConditionNames> names = getConditionNames();
+	return names != nullptr ? names->getStimClasses() : std::vector<int>();
 }
 
 void SyncSink::clearVars()
 {
-	conditionMap.clear();
-	conditionList.clear();
-	conditionListInverse.clear();
-	nTrialsByStimClass.clear();
+	imageIndex.clear();
+	conditionNames.clear();
+	conditionNamesChanged = true;
+	rebinner.cancel();
+	trialLog.clear();
+	spikeRaster.clear();
 	spikeTensor.clear();
-	stimClasses.clear();
+	trialSpikes.clear();
+	trialPending = false;
 	numConditions = 0;
 	nTrials = 0;
 	currentStimClass = -1;
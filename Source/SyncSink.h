@@ -27,6 +27,22 @@
 
 #include <ProcessorHeaders.h>
 
+#include "PSTHTensor.h"
+#include "SyncSinkEngine.h"
+#include "SpikeHistory.h"
+#include "TrialLog.h"
+#include "SpikeRaster.h"
+#include "SessionSnapshot.h"
+#include "PSTHRebinner.h"
+#include "ShardedBinner.h"
+#include "HistogramPublisher.h"
+#include "TrialEvent.h"
+#include "ImageIndex.h"
+#include "ConditionNames.h"
+#include "KofikoMessage.h"
+
+#include <limits>
+
 
 /** 
 	A plugin that includes a canvas for displaying incoming data
@@ -72,35 +88,58 @@ public:
 	void handleSpike(SpikePtr spike) override;
 
 	/** Handles broadcast messages sent during acquisition
-		Called automatically whenever a broadcast message is sent through the signal chain */
+		Called automatically whenever a broadcast message is sent through the signal chain.
+		The message is queued for the engine thread; see applyTrialMessage() */
 	void handleBroadcastMessage(String message) override;
 
-	/** Saving custom settings to XML. This method is not needed to save the state of
-		Parameter objects */
+	/** Has the engine save the PSTH state (design, tensor, trial log) to this node's
+		session file in the background, and records its path. Parameter objects are
+		saved by the GUI */
 	void saveCustomParametersToXml(XmlElement* parentElement) override;
 
-	/** Load custom settings from XML. This method is not needed to load the state of
-		Parameter objects*/
+	/** Maps the session file named by saveCustomParametersToXml() and has the
+		engine restore it, then rebin it to the loaded parameters. Parameter objects
+		are loaded by the GUI */
 	void loadCustomParametersFromXml(XmlElement* parentElement) override;
 
 	void run() override;
 
 	bool startAcquisition() override;
 
+	/** Reports the commands the engine dropped during the acquisition */
+	bool stopAcquisition() override;
+
 	//SyncSinkCanvas* syncSinkCanvas = nullptr;
-	std::vector<double> getHistogram(int channel_idx, int sorted_id, int stim_class);
+	/** Read access for zero-copy readers; see PSTHTensor::ReadScope and PSTHTensor::getView() */
+	const PSTHTensor& getSpikeTensor() const;
+	/** Spike times of the recent trials, for raster views; see SpikeRaster::getRows() */
+	const SpikeRaster& getSpikeRaster() const { return spikeRaster; }
 	int getNTrial();
 	void setCanvas(SyncSinkCanvas* c);
 	void setEditor(SyncSinkEditor* e);
 	void addPSTHPlot(int channel_idx, int sorted_id, std::vector<int> stimClasses);
 	void resetTensor();
-	void rebin(int n_bins, int bin_size);
+	void rebin(int n_bins, int bin_size, int pre_window);
+
+	/** Stim class names as of the last design change, for the message thread. The
+		engine publishes an immutable copy once it has applied a run of changes, so
+		readers take it without locking; null until the first design is installed */
+	std::shared_ptr<const ConditionNames> getConditionNames() const;
 	String getStimClassLabel(int stim_class);
-	int getNBins();
-	int getBinSize();
 	std::vector<int> getStimClasses();
 	void clearVars();
-	int numConditions = -1;
+
+	/** What the canvas has to redraw. The engine only sets these flags; the
+		canvas takes them on the message thread at a bounded frame rate */
+	enum CanvasChange
+	{
+		PLOTS_CHANGED = 1, // histogram contents (plots compare tensor versions to find which)
+		LEGEND_CHANGED = 2, // trial count
+		LAYOUT_CHANGED = 4 // stim classes or bin layout: plots, legend and layout
+	};
+	void markCanvasDirty(int changes) { canvasChanges.fetch_or(changes, std::memory_order_release); }
+	int takeCanvasChanges() { return canvasChanges.exchange(0, std::memory_order_acquire); }
+
 	SyncSinkCanvas* canvas = nullptr;
 	SyncSinkEditor* thisEditor = nullptr;
 
@@ -110,26 +149,173 @@ private:
 	/** Generates an assertion if this class leaks */
 	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SyncSink);
 
-	HashMap<String, String> conditionMap; // hashmap for image ids
-	HashMap<String, int> conditionList; // hashmap for condition indexing
-	HashMap<int, String> conditionListInverse; // hashmap for index to condition string
-	HashMap<int, int> nTrialsByStimClass; // hashmap storing num trials for each condition
-	std::vector<int> stimClasses;
+	/* The engine thread is the only caller of the apply methods below and the
+	   only thread that mutates the trial state and spikeTensor */
+	friend class SyncSinkEngine;
+	std::unique_ptr<SyncSinkEngine> engine;
+
+	/** Bins spikes [begin, end) of a batch into the current trial's stim class */
+	void binSpikes(const SpikeBatchView& batch, int begin, int end);
+
+	/** Queues a spike of the current trial with its offset from TrialAlign */
+	void addTrialSpike(int channel_idx, int sorted_id, int stream_id, int64 sample_number, int64 timestamp);
+
+	/** Records that stream_id reached sample_number at a software timestamp */
+	void updateStreamClock(int stream_id, int64 sample_number, double sample_rate, int64 timestamp);
+
+	/** Sample number of a stream at the current TrialAlign, or -1 if the stream clock is unknown */
+	int64 getAlignSample(int stream_id);
+
+	/** Folds the spikes of the current trial into spikeTensor and counts the trial */
+	void commitTrial();
+
+	/** Discards the current trial after an allocation failed while a command was applied */
+	void dropTrial();
+
+	/** Stores the spike times of a committed trial (trialSpikes, sorted) in spikeRaster */
+	void addRasterTrial(int trial, const std::vector<int64>& sample_rates);
+
+	/** Parses a Kofiko message (ClearDesign, AddCondition, TrialStart, ...) */
+	void applyTrialMessage(std::string_view message, int64 timestamp);
+
+	/** Applies a binary trial event; name is the AddCondition name, if any */
+	void applyTrialEvent(const TrialEvent& event, std::string_view name, int64 timestamp);
+
+	/** Reads the arguments of a text AddCondition and adds the condition */
+	void applyAddCondition(KofikoMessage& tokens);
+
+	/* Trial events, shared by the text and binary protocols */
+	void clearDesign();
+	void addCondition(std::string_view name);
+
+	/** SetDesign: clears the design, then defers the tensor resize and canvas
+		update of every addCondition() until endDesign() */
+	void beginDesign();
+	void endDesign();
+	void startTrial(int stim_class);
+	void alignTrial(int64 timestamp);
+	void endTrial();
+
+	/** Switches the displayed layout in place when the tensor's base layout
+		covers it, and rebuilds from the trial log otherwise */
+	void applyRebin(int n_bins, int bin_size, int pre_window);
+
+	/** Storage layout for a displayed layout: bins of gcd(bin size, resolution) ms over the same window */
+	PSTHBinning getBaseBinning(const PSTHBinning& display) const;
+
+	/** Re-lays out spikeTensor for a displayed layout */
+	void setTensorBinning(const PSTHBinning& display);
+
+	/** Switches to the tensor of a finished rebin job; called by the engine on every loop */
+	void finishRebin();
+
+	/** Gives the publisher a capture if it asked for one (e.g. for a new subscriber); called by the engine on every loop */
+	void refreshPublisher();
+
+	/** Publishes conditionNames if it changed; called by the engine whenever its queues run dry,
+		so a burst of AddCondition messages is copied once */
+	void refreshConditionNames();
+
+	/** Sample rates (Hz) of the known streams, by stream id; 0 if unknown */
+	std::vector<int64> getStreamSampleRates() const;
+	void applyReset();
+
+	/** Copies the session state, refilling tensorCapture; engine thread, between two commands */
+	std::unique_ptr<SessionSnapshot> takeSnapshot();
+
+	/** Engine side of saveCustomParametersToXml(): queues a snapshot for the session file */
+	void applySnapshot();
+
+	/** Replaces the design, tensor and trial log with those of a session file */
+	void applyRestore(const SessionSnapshotFile& file);
+
+	/** Folder of the session files (and of file-backed tensors), in the user's application data folder */
+	File getSnapshotDirectory() const;
+
+	/** Session file of this node, overwritten by the autosave and by every settings save */
+	File getAutosaveFile() const;
+
+	ImageIndex imageIndex; // image id -> stim class
+	int numConditions = -1; // engine thread; other threads read getConditionNames()
+	ConditionNames conditionNames; // engine thread
+	bool conditionNamesChanged = false; // since the last refreshConditionNames()
+	std::shared_ptr<const ConditionNames> publishedConditionNames; // swapped with std::atomic_store
 	int currentStimClass = -1;
 	int64 currentTrialStartTime = -1;
 	bool inTrial = false;
-	std::vector<std::vector<std::vector<std::vector<double>>>> spikeTensor; // n_channels * n_units * n_stim_classes * n_bins tensor for spike counts
-
-	int nBins = 50; // default num bins
-	int binSize = 10; // default bin sizes
+	bool trialPending = false; // a stim class was assigned and the trial has not been committed yet
+	int64 lastSenderTime = std::numeric_limits<int64>::min(); // of the last binary event
+	bool installingDesign = false; // between beginDesign() and endDesign()
+	std::atomic<int> canvasChanges{ 0 }; // CanvasChange flags not yet taken by the canvas
+	static const uint32 maxConditions = 1 << 20; // sanity bound on a binary SetDesign
+
+	std::vector<TrialLog::Spike> trialSpikes; // spikes of the current trial, binned at commitTrial()
+	TrialLog trialLog; // committed trials up to its cap, for lossless rebinning
+	SpikeRaster spikeRaster; // the last "rastertrials" trials of each stim class, per unit
+	std::vector<float> rasterOffsets; // one unit's offsets in ms, reused across trials
+	PSTHRebinner rebinner;
+	ShardedBinner binner; // bins committed trials, on channel-sharded workers if binThreads > 0
+	std::atomic<int> binThreads{ 0 }; // "binthreads" parameter; applied by the engine at the next commit
+
+	/* Session snapshots: written every autosaveInterval at a TrialEnd, so a
+	   crash loses at most that much, and whenever the settings are saved */
+	SessionSnapshotWriter snapshotWriter;
+	std::shared_ptr<PSTHTensor::Capture> tensorCapture; // engine thread; shared with the writer until written
+	int64 lastAutosave = -1; // software timestamp (ms); -1 until the first TrialEnd
+	static const int64 autosaveInterval = 60000; // ms
+
+	PSTHTensor spikeTensor; // n_channels * n_units * n_stim_classes * n_bins spike counts, plus trials per stim class
+
+	PSTHBinning binning; // displayed layout of spikeTensor; changes once a rebin has been applied
+	std::atomic<int> resolution{ 1 }; // "resolution" parameter: ms per base bin of spikeTensor
+	int preWindow = 0; // ms of pre-stimulus baseline shown before TrialAlign
+	SpikeHistory spikeHistory; // recent spikes, binned retroactively when a trial is aligned
 	int nTrials = 0;
 	void* context;
-	void* socket;
-	int dataport;
+
+	/* Trial-event transport. REP answers every message before the next one
+	   can be sent; PULL and SUB let the stimulus computer pipeline events,
+	   optionally batched as multipart messages. The socket belongs to the
+	   network thread, which re-opens it when the parameters change */
+	enum Transport { TRANSPORT_REP, TRANSPORT_PULL, TRANSPORT_SUB };
+	void openSocket();
+	void closeSocket();
+
+	/** Queues one received frame: a binary TrialEvent, or else a text message */
+	void postFrame(const void* data, size_t size, int64 timestamp);
+	void* socket = nullptr;
+	int socketMode = TRANSPORT_REP; // type of the open socket
+	CriticalSection transportLock; // guards transportMode and transportEndpoint
+	int transportMode = TRANSPORT_REP;
+	String transportEndpoint = "tcp://*:5557";
+	std::atomic<bool> transportChanged{ true };
+
+	/* Changed PSTHs are published after every TrialEnd ("publish" parameter; off if empty) */
+	std::unique_ptr<HistogramPublisher> publisher;
 
 	int64 startTimestamp = 0; // software timestamp at start of acquisition
+	int64 droppedAtStart = 0; // engine->getNumDropped() at start of acquisition
+
+	/** Audio thread: stamps the spikes gathered since the last call and queues them as one batch */
+	void postSpikeBatch();
+	SpikeBatch spikeBatch; // spikes of the current process() block
+	std::vector<double> spikeSamplesPerMs; // by stream id; looked up at a stream's first spike
 	int sampleRate = 0; // sample rate
 
+	/* Sample-clock alignment: each process() block anchors a stream's sample
+	   counter to the software clock, TrialAlign is mapped onto every stream's
+	   samples once per trial, and spikes are binned by integer sample offsets */
+	struct StreamClock
+	{
+		int64 anchorSample = -1; // last sample of the most recent block
+		int64 anchorTime = 0; // software timestamp (ms) of that block
+		int64 sampleRate = 0; // Hz, rounded
+	};
+	std::vector<StreamClock> streamClocks; // by stream id
+	std::vector<int64> trialAlignSamples; // by stream id; -1 until first needed in a trial
+	std::atomic<bool> useSampleClock{ false }; // "alignment" parameter
+	bool trialUsesSampleClock = false; // alignment mode latched at TrialAlign
+
 };
 
 #endif // SyncSink_H_DEFINED
\ No newline at end of file
@@ -26,8 +26,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <VisualizerWindowHeaders.h>
 
+#include "PSTHTensor.h"
+
 class SyncSink;
 class SyncSinkDisplay;
+class SyncSinkLegend;
+class PopulationHeatmap;
 class PSTHPlot;
 /**
 * 
@@ -68,23 +72,65 @@ public:
 		Colour(226,118,193), Colour(126,126,126), Colour(187,188,33),
 		Colour(22,189,206) };
 
+	/** Colour of a stim class: colorList first, then hues spaced by the golden angle */
+	Colour getClassColour(int stim_class) const;
+
 	void updateLegend();
 
 private:
 
+	/** Message-thread timer that applies the changes the engine marked on the processor */
+	class RedrawTimer : public Timer
+	{
+	public:
+		RedrawTimer(SyncSinkCanvas& c) : canvas(c) {}
+		void timerCallback() override { canvas.redrawChanges(); }
+
+	private:
+		SyncSinkCanvas& canvas;
+	};
+
+	/** Redraws whatever changed since the last frame; bursts of trial events coalesce into one frame */
+	void redrawChanges();
+
+	/** Applies the "view" and "select" parameters: PSTH grid or population heatmap */
+	void updateView();
+
+	RedrawTimer redrawTimer;
+	static const int frameRate = 30; // Hz
+
 	/** Pointer to the processor class */
 	SyncSink* processor;
 
 	/** Class for plotting data */
 	InteractivePlot plt;
 
-	ScopedPointer<Viewport> viewport;
+	/** Lays out the visible part of its grid whenever it scrolls */
+	class PlotViewport : public Viewport
+	{
+	public:
+		void visibleAreaChanged(const Rectangle<int>& area) override;
+		SyncSinkDisplay* display = nullptr;
+	};
+
+	ScopedPointer<PlotViewport> viewport;
 	ScopedPointer<SyncSinkDisplay> display;
+	ScopedPointer<Viewport> legendViewport;
+	ScopedPointer<SyncSinkLegend> legend;
+	ScopedPointer<PopulationHeatmap> heatmap; // replaces the plot grid in the heatmap views
 
 	/** Generates an assertion if this class leaks */
 	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SyncSinkCanvas);
 };
 
+/**
+	Scrolling grid of PSTH plots, any number of them, inside the canvas viewport.
+
+	Only the plots in the visible rows exist as components: a small pool of
+	PSTHPlots is re-bound to whichever grid cells are in view after every
+	scroll or resize, keeping its bindings (and their caches) for cells that
+	stay in view.
+*/
 class SyncSinkDisplay : public Component
 {
 public:
@@ -96,16 +142,112 @@ public:
     void removePlots();
     void clear();
 
+    /** Repaints the visible plots whose histograms changed */
     void updatePlots();
+
+    /** Adds a plot to the end of the grid, or replaces the stim classes of an existing (channel_idx, sorted_id) plot */
     void addPSTHPlot(int channel_idx, int sorted_id, std::vector<int> stimClasses);
 
+    /** Sizes the grid to the viewport and the number of plots */
+    void updateLayout();
+
+    /** Binds pooled plots to the cells in view */
+    void layoutVisible();
+
+    /** Shows spike rasters instead of histograms in every plot */
+    void setRaster(bool raster);
+
 private:
+    struct PlotSpec
+    {
+        int channel_idx;
+        int sorted_id;
+        std::vector<int> stimClasses;
+    };
+
     SyncSink* processor;
-    int plotCounter = 0;
     SyncSinkCanvas* canvas;
     Viewport* viewport;
-    OwnedArray<PSTHPlot> plots;
+    std::vector<PlotSpec> specs; // every plot, in grid order
+    OwnedArray<PSTHPlot> plots; // component pool for the visible cells
+
+    static const int columns = 4;
+    static const int minRowHeight = 150;
+    int rowHeight = minRowHeight;
+    bool raster = false;
+};
+
+/**
+	Population overview: one image row per (channel, unit) for a stim class,
+	or per stim class for a (channel, unit), one pixel per bin, each row
+	coloured relative to its own peak rate.
+
+	Rows are re-rendered straight from the spike tensor only when their
+	histogram version changes, so a trial costs the rows it touched.
+*/
+class PopulationHeatmap : public Component
+{
+public:
+    enum Mode
+    {
+        UNITS, // every (channel, unit) for one stim class
+        CONDITIONS // every stim class for one (channel, unit)
+    };
 
+    PopulationHeatmap(SyncSink* s);
+    void paint(Graphics& g) override;
+
+    /** Chooses what to show; drops the image if it changed */
+    void setSelection(Mode mode, int stim_class, int channel_idx, int sorted_id);
+
+    /** Re-renders the rows that changed in the tensor; returns true if any did */
+    bool refresh();
+
+private:
+    struct Row
+    {
+        int channel_idx;
+        int sorted_id;
+        int stim_class;
+    };
+
+    /** Colours one image row from a histogram */
+    void renderRow(int row, const PSTHTensor::HistogramView& view, Image::BitmapData& pixels);
+
+    /** 256-entry colour map, as native ARGB pixels */
+    static const std::vector<uint32>& getColourMap();
+
+    SyncSink* processor;
+    Mode mode = UNITS;
+    int stimClass = 0;
+    int channelIdx = 0;
+    int sortedId = 0;
+
+    std::vector<Row> rows;
+    std::vector<uint32> rowVersions; // tensor version each image row was rendered at
+    std::vector<float> rates; // scratch row
+    Image image; // rows.size() x bins
+    int preBins = 0;
+    int rowExtent = -1; // channels * units, or stim classes, the rows were built for
+};
+
+/**
+	Stim class legend; sized for every class but only paints the rows in view.
+*/
+class SyncSinkLegend : public Component
+{
+public:
+    SyncSinkLegend(SyncSink* s, SyncSinkCanvas* c);
+    void paint(Graphics& g) override;
+
+    /** Sizes the list for the current number of stim classes */
+    void updateLayout(int width);
+
+    static const int rowHeight = 20;
+
+private:
+    SyncSink* processor;
+    SyncSinkCanvas* canvas;
 };
 
 class PSTHPlot : public Component
@@ -121,6 +263,15 @@ public:
     void resized();
     void clearPlot();
 
+    /** True if a histogram changed in the tensor since the last paint */
+    bool isStale() const;
+
+    /** Shows another (channel, unit) or set of stim classes; drops the caches if it differs */
+    void setPlot(int channel_idx, int sorted_id, const std::vector<int>& stim_classes);
+
+    /** Draws one row per recent trial instead of the histograms */
+    void setRaster(bool raster);
+
     //void updatePlot();
 
     int channel_idx;
@@ -134,8 +285,33 @@ private:
     SyncSinkCanvas* canvas;
     Font font;
     String name;
-    std::vector<double> histogram;
     bool alive;
+
+    /** Re-reads the histograms whose version changed since the last paint */
+    void refreshHistograms();
+
+    /** Draws a band of trial rows per stim class, reading only the trials that fit */
+    void paintRaster(Graphics& g);
+
+    /** Rebuilds the path and error band of one stim class for a plot width in pixels */
+    void rebuildPath(int c, int width);
+    void rebuildBand(int c, int width);
+
+    std::vector<std::vector<double>> histograms; // rates per stim class, in stimClasses order
+    std::vector<std::vector<double>> errors; // standard error of each rate
+    std::vector<uint32> histogramVersions; // tensor version each cached histogram was read at
+    int preBins = 0; // leading pre-stimulus bins of the cached histograms
+    int binSize = 0; // ms per bin of the cached histograms
+    bool raster = false;
+
+    /* Paths are built in bins (x) and spikes/s (y) and drawn through a
+       transform, so a new y-scale or height does not rebuild them. They are
+       rebuilt when their histogram's version or the plot width changes */
+    std::vector<Path> paths; // per stim class
+    std::vector<Path> bands; // mean +/- SEM, per stim class; empty until there are two trials
+    std::vector<double> maxRates; // peak of each cached histogram, error band included
+    std::vector<bool> pathsValid;
+    int pathWidth = 0; // plot width the paths were decimated for
 };
 
 #endif // SPECTRUMCANVAS_H_INCLUDED
\ No newline at end of file
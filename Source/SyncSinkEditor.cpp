@@ -33,11 +33,21 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 SyncSinkEditor::SyncSinkEditor(GenericProcessor* p)
     : VisualizerEditor(p, "Visualizer", 200), syncSinkCanvas(nullptr)
 {
-    desiredWidth = 250;
+    desiredWidth = 550;
     addTextBoxParameterEditor("plot", 20, 20);
     //addTextBoxParameterEditor("cluster", 120, 20);
     addTextBoxParameterEditor("nbins", 20, 60);
     addTextBoxParameterEditor("binsize", 120, 60);
+    addComboBoxParameterEditor("alignment", 20, 100);
+    addTextBoxParameterEditor("prewindow", 120, 100);
+    addTextBoxParameterEditor("resolution", 120, 20);
+    addComboBoxParameterEditor("transport", 220, 20);
+    addTextBoxParameterEditor("endpoint", 220, 60);
+    addComboBoxParameterEditor("view", 320, 20);
+    addTextBoxParameterEditor("select", 320, 60);
+    addTextBoxParameterEditor("rastertrials", 220, 100);
+    addTextBoxParameterEditor("binthreads", 320, 100);
+    addTextBoxParameterEditor("publish", 420, 20);
     //addSelectedChannelsParameterEditor("Channels", 20, 105);
 
 }
@@ -0,0 +1,354 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "SyncSinkEngine.h"
+#include "SyncSink.h"
+
+#include <limits>
+#include <new>
+
+SyncSinkEngine::SyncSinkEngine(SyncSink* s)
+	: Thread("SyncSinkEngineThread"), processor(s),
+	audioQueue(1 << 16), networkQueue(1 << 10), controlQueue(64),
+	audioText(1 << 18), audioSpikes(1 << 22), networkText(1 << 20)
+{
+}
+
+SyncSinkEngine::~SyncSinkEngine()
+{
+	if (!stopThread(1000)) {
+		std::cerr << "Engine thread timeout." << std::endl;
+	}
+	drain(audioQueue);
+	drain(networkQueue);
+	drain(controlQueue);
+}
+
+void SyncSinkEngine::postSpikes(const SpikeBatch& batch)
+{
+	int n = batch.size();
+	if (n == 0)
+	{
+		return;
+	}
+	size_t size = SpikeBatch::getRecordSize(n);
+	int64 position = audioSpikes.allocate(size);
+	if (position < 0)
+	{
+		numDropped++;
+		return;
+	}
+	batch.write(audioSpikes.at(position));
+
+	EngineCommand command;
+	command.type = EngineCommand::SPIKES;
+	command.timestamp = batch.timestamp[0];
+	command.nSpikes = n;
+	command.text = &audioSpikes;
+	command.textPosition = position;
+	command.textLength = (int)size;
+	post(audioQueue, command);
+}
+
+void SyncSinkEngine::postClock(int stream_id, int64 sample_number, double sample_rate, int64 timestamp)
+{
+	EngineCommand command;
+	command.type = EngineCommand::CLOCK;
+	command.timestamp = timestamp;
+	command.streamId = stream_id;
+	command.sampleNumber = sample_number;
+	command.sampleRate = sample_rate;
+	post(audioQueue, command);
+}
+
+void SyncSinkEngine::postBroadcastMessage(const String& message, int64 timestamp)
+{
+	EngineCommand command;
+	command.type = EngineCommand::MESSAGE;
+	command.timestamp = timestamp;
+	/* the audio thread must not allocate: a message the ring cannot take is dropped */
+	if (!attachText(command, audioText, message.toRawUTF8(), message.getNumBytesAsUTF8(), false))
+	{
+		numDropped++;
+		return;
+	}
+	post(audioQueue, command);
+}
+
+void SyncSinkEngine::postNetworkMessage(const char* data, size_t size, int64 timestamp)
+{
+	EngineCommand command;
+	command.type = EngineCommand::MESSAGE;
+	command.timestamp = timestamp;
+	attachText(command, networkText, data, size, true);
+	post(networkQueue, command);
+}
+
+void SyncSinkEngine::postNetworkEvent(const TrialEvent& event, int64 timestamp)
+{
+	EngineCommand command;
+	command.type = EngineCommand::EVENT;
+	command.timestamp = timestamp;
+	command.event = event;
+	command.event.payload = nullptr;
+	command.event.payloadSize = 0;
+	if ((event.type == TrialEvent::ADD_CONDITION || event.type == TrialEvent::SET_DESIGN) && event.payloadSize > 0)
+	{
+		attachText(command, networkText, (const char*)event.payload, event.payloadSize, true);
+	}
+	post(networkQueue, command);
+}
+
+void SyncSinkEngine::postRebin(int n_bins, int bin_size, int pre_window)
+{
+	EngineCommand command;
+	command.type = EngineCommand::REBIN;
+	command.nBins = n_bins;
+	command.binSize = bin_size;
+	command.preWindow = pre_window;
+	post(controlQueue, command);
+}
+
+void SyncSinkEngine::postReset()
+{
+	EngineCommand command;
+	command.type = EngineCommand::RESET;
+	post(controlQueue, command);
+}
+
+void SyncSinkEngine::postSnapshot()
+{
+	EngineCommand command;
+	command.type = EngineCommand::SNAPSHOT;
+	post(controlQueue, command);
+}
+
+void SyncSinkEngine::postRestore(std::unique_ptr<SessionSnapshotFile> file)
+{
+	EngineCommand command;
+	command.type = EngineCommand::RESTORE;
+	command.restore = file.release();
+	post(controlQueue, command);
+}
+
+void SyncSinkEngine::post(SpscQueue<EngineCommand>& queue, EngineCommand& command)
+{
+	if (!queue.push(command))
+	{
+		/* text left in a ring is freed with the next command's */
+		delete command.message;
+		delete command.restore;
+		numDropped++;
+	}
+}
+
+bool SyncSinkEngine::attachText(EngineCommand& command, SpscByteQueue& ring, const char* data, size_t size, bool may_allocate)
+{
+	int64 position = ring.write(data, size);
+	if (position >= 0)
+	{
+		command.text = &ring;
+		command.textPosition = position;
+		command.textLength = (int)size;
+		return true;
+	}
+	if (!may_allocate)
+	{
+		return false;
+	}
+	command.message = new String(String::fromUTF8(data, (int)size));
+	return true;
+}
+
+SpikeBatchView SyncSinkEngine::getSpikes(const EngineCommand& command)
+{
+	return SpikeBatch::read(command.text->at(command.textPosition), command.nSpikes);
+}
+
+std::string_view SyncSinkEngine::getText(const EngineCommand& command)
+{
+	if (command.message != nullptr)
+	{
+		return std::string_view(command.message->toRawUTF8(), command.message->getNumBytesAsUTF8());
+	}
+	if (command.text != nullptr)
+	{
+		return std::string_view(command.text->at(command.textPosition), command.textLength);
+	}
+	return std::string_view();
+}
+
+void SyncSinkEngine::releaseText(EngineCommand& command)
+{
+	if (command.text != nullptr)
+	{
+		command.text->release(command.textPosition, command.textLength);
+		command.text = nullptr;
+	}
+	delete command.message;
+	command.message = nullptr;
+}
+
+void SyncSinkEngine::run()
+{
+	while (!threadShouldExit())
+	{
+		processor->finishRebin();
+		processor->refreshPublisher();
+		if (!applyNext())
+		{
+			processor->refreshConditionNames();
+			wait(1);
+		}
+	}
+}
+
+bool SyncSinkEngine::applyNext()
+{
+	if (EngineCommand* control = controlQueue.front())
+	{
+		apply(*control);
+		controlQueue.pop();
+		return true;
+	}
+
+	EngineCommand* spike = audioQueue.front();
+	EngineCommand* event = networkQueue.front();
+
+	if (spike != nullptr && (event == nullptr || spike->timestamp < event->timestamp))
+	{
+		if (spike->type == EngineCommand::SPIKES)
+		{
+			/* a batch stops at the next event, which then goes first, as it would between single spikes */
+			applySpikes(*spike, event != nullptr ? event->timestamp : std::numeric_limits<int64>::max());
+			if (spike->nextSpike < spike->nSpikes)
+			{
+				return true;
+			}
+			releaseText(*spike);
+		}
+		else
+		{
+			apply(*spike);
+		}
+		audioQueue.pop();
+		return true;
+	}
+	if (event != nullptr && (spike != nullptr
+		|| CoreServices::getSoftwareTimestamp() - event->timestamp >= reorderWindow))
+	{
+		apply(*event);
+		networkQueue.pop();
+		return true;
+	}
+	return false;
+}
+
+void SyncSinkEngine::apply(EngineCommand& command)
+{
+	/* the tensor and the trial state stay consistent when an allocation fails
+	   (buffers are swapped in only once allocated); the trial is given up */
+	try
+	{
+		switch (command.type)
+		{
+		case EngineCommand::SPIKES:
+			applySpikes(command, std::numeric_limits<int64>::max());
+			releaseText(command);
+			break;
+		case EngineCommand::CLOCK:
+			processor->updateStreamClock(command.streamId, command.sampleNumber, command.sampleRate, command.timestamp);
+			break;
+		case EngineCommand::MESSAGE:
+			processor->applyTrialMessage(getText(command), command.timestamp);
+			releaseText(command);
+			break;
+		case EngineCommand::EVENT:
+			processor->applyTrialEvent(command.event, getText(command), command.timestamp);
+			releaseText(command);
+			break;
+		case EngineCommand::REBIN:
+			processor->applyRebin(command.nBins, command.binSize, command.preWindow);
+			break;
+		case EngineCommand::RESET:
+			processor->applyReset();
+			break;
+		case EngineCommand::SNAPSHOT:
+			processor->applySnapshot();
+			break;
+		case EngineCommand::RESTORE:
+			processor->applyRestore(*command.restore);
+			delete command.restore; // unmaps the file
+			command.restore = nullptr;
+			break;
+		}
+	}
+	catch (const std::bad_alloc&)
+	{
+		releaseText(command);
+		delete command.restore;
+		command.restore = nullptr;
+		processor->dropTrial();
+	}
+}
+
+void SyncSinkEngine::applySpikes(EngineCommand& command, int64 limit)
+{
+	SpikeBatchView batch = getSpikes(command);
+	int end = command.nextSpike;
+	while (end < batch.size && batch.timestamp[end] < limit)
+	{
+		end++;
+	}
+	try
+	{
+		processor->binSpikes(batch, command.nextSpike, end);
+	}
+	catch (const std::bad_alloc&)
+	{
+		command.nextSpike = batch.size; // the rest of the batch goes with the trial
+		processor->dropTrial();
+		return;
+	}
+	command.nextSpike = end;
+	if (end < batch.size)
+	{
+		command.timestamp = batch.timestamp[end];
+	}
+}
+
+void SyncSinkEngine::drain(SpscQueue<EngineCommand>& queue)
+{
+	while (EngineCommand* command = queue.front())
+	{
+		/* a settings save the engine did not reach is still captured; the
+		   engine thread has stopped, so its state can be read from here */
+		if (command->type == EngineCommand::SNAPSHOT)
+		{
+			processor->applySnapshot();
+		}
+		releaseText(*command);
+		delete command->restore;
+		queue.pop();
+	}
+}
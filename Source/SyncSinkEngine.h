@@ -0,0 +1,180 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef SYNCSINKENGINE_H_DEFINED
+#define SYNCSINKENGINE_H_DEFINED
+
+#include <ProcessorHeaders.h>
+
+#include "SpikeBatch.h"
+#include "SpscQueue.h"
+#include "TrialEvent.h"
+#include "SessionSnapshot.h"
+
+#include <string_view>
+
+class SyncSink;
+
+/**
+	Fixed-size command passed from a producer thread to the engine.
+	Text messages (and the names of a binary AddCondition or SetDesign) and
+	spike batches are the only variable-size payloads; they are copied into
+	the byte ring that goes with the command's queue. Network text that does
+	not fit goes into a heap String owned by the command; the audio thread
+	never allocates, so its commands are dropped instead. Binary trial events
+	travel inline.
+*/
+struct EngineCommand
+{
+	enum Type
+	{
+		SPIKES,
+		CLOCK,
+		MESSAGE,
+		EVENT,
+		REBIN,
+		RESET,
+		SNAPSHOT,
+		RESTORE
+	};
+
+	Type type = SPIKES;
+	int64 timestamp = 0; // software timestamp (ms) used to order commands across queues; SPIKES: of the next spike to apply
+
+	/* SPIKES: the batch is the ring record; nextSpike advances as the engine applies it */
+	int nSpikes = 0;
+	int nextSpike = 0;
+
+	/* CLOCK */
+	int streamId = 0;
+	int64 sampleNumber = 0;
+	double sampleRate = 0;
+
+	/* REBIN */
+	int nBins = 0;
+	int binSize = 0;
+	int preWindow = 0;
+
+	/* MESSAGE; EVENT: AddCondition / SetDesign names, if any; SPIKES */
+	SpscByteQueue* text = nullptr; // ring holding textLength bytes at textPosition
+	int64 textPosition = 0;
+	int textLength = 0;
+	String* message = nullptr; // network only: fallback for text too large for the ring
+
+	/* EVENT; the payload pointer is not carried over */
+	TrialEvent event;
+
+	/* RESTORE; owned by the command */
+	SessionSnapshotFile* restore = nullptr;
+};
+
+/**
+	Single owner of the SyncSink trial state and spike tensor.
+
+	The audio thread (spikes and broadcast messages), the network thread
+	(Kofiko messages) and the message thread (rebin/reset) each push into
+	their own lock-free SPSC queue. The engine thread drains the queues and
+	applies the commands in timestamp order, so all mutation of the PSTH
+	state happens on one thread and producers never wait on a lock.
+*/
+class SyncSinkEngine : public Thread
+{
+public:
+	SyncSinkEngine(SyncSink* s);
+	~SyncSinkEngine();
+
+	/** Audio thread: queue a stamped batch of spikes for binning; the batch can be reused on return */
+	void postSpikes(const SpikeBatch& batch);
+
+	/** Audio thread: queue the sample number of a stream reached at a software timestamp */
+	void postClock(int stream_id, int64 sample_number, double sample_rate, int64 timestamp);
+
+	/** Audio thread: queue a broadcast message received through the signal chain */
+	void postBroadcastMessage(const String& message, int64 timestamp);
+
+	/** Network thread: queue a text message received over ZMQ */
+	void postNetworkMessage(const char* data, size_t size, int64 timestamp);
+
+	/** Network thread: queue a binary trial event received over ZMQ */
+	void postNetworkEvent(const TrialEvent& event, int64 timestamp);
+
+	/** Message thread: queue a bin layout change */
+	void postRebin(int n_bins, int bin_size, int pre_window);
+
+	/** Message thread: queue a reset of the accumulated histograms */
+	void postReset();
+
+	/** Message thread: queue a capture of the session state (see SyncSink::takeSnapshot()) */
+	void postSnapshot();
+
+	/** Message thread: queue the replacement of the session state with a mapped session file */
+	void postRestore(std::unique_ptr<SessionSnapshotFile> file);
+
+	/** Number of commands dropped because a queue or the audio thread's ring was full */
+	int64 getNumDropped() const { return numDropped.load(); }
+
+	void run() override;
+
+private:
+	/** Applies the next command in timestamp order; returns false if nothing was ready */
+	bool applyNext();
+
+	void apply(EngineCommand& command);
+
+	/** Applies the spikes of a SPIKES command up to the first one stamped at or after limit */
+	void applySpikes(EngineCommand& command, int64 limit);
+
+	/** Engine: the batch of a SPIKES command, in place */
+	static SpikeBatchView getSpikes(const EngineCommand& command);
+	void post(SpscQueue<EngineCommand>& queue, EngineCommand& command);
+	void drain(SpscQueue<EngineCommand>& queue);
+
+	/** Producer: copies a command's text into ring, or onto the heap if the ring is full and
+		may_allocate is set. Returns false if the text was not attached */
+	static bool attachText(EngineCommand& command, SpscByteQueue& ring, const char* data, size_t size, bool may_allocate);
+
+	/** Engine: the text of a command, in place */
+	static std::string_view getText(const EngineCommand& command);
+
+	/** Engine: frees the text of an applied or discarded command */
+	static void releaseText(EngineCommand& command);
+
+	SyncSink* processor;
+
+	SpscQueue<EngineCommand> audioQueue;
+	SpscQueue<EngineCommand> networkQueue;
+	SpscQueue<EngineCommand> controlQueue;
+	SpscByteQueue audioText;
+	SpscByteQueue audioSpikes;
+	SpscByteQueue networkText;
+
+	std::atomic<int64> numDropped{ 0 };
+
+	/* Network messages are held back this long (ms) so spikes still in the
+	   audio pipeline with earlier timestamps are binned first */
+	const int64 reorderWindow = 20;
+
+	JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SyncSinkEngine);
+};
+
+#endif // SYNCSINKENGINE_H_DEFINED
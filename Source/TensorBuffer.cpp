@@ -0,0 +1,133 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "TensorBuffer.h"
+
+#include <cstdlib>
+#include <new>
+
+#if ! JUCE_WINDOWS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/* below this a plain zeroed allocation is cheaper than a mapping */
+static const size_t mappingThreshold = 4 << 20;
+
+TensorBuffer::TensorBuffer(size_t count_, const Policy& policy)
+{
+	if (count_ == 0)
+	{
+		return;
+	}
+	size_t bytes = count_ * sizeof(uint32);
+	void* memory = nullptr;
+#if ! JUCE_WINDOWS
+	if (bytes >= policy.mappedThreshold)
+	{
+		memory = mapFile(bytes, policy.directory);
+		kind = FILE_MAPPING;
+	}
+	if (memory == nullptr && bytes >= mappingThreshold)
+	{
+		memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (memory == MAP_FAILED)
+		{
+			memory = nullptr;
+		}
+#ifdef MADV_HUGEPAGE
+		else
+		{
+			madvise(memory, bytes, MADV_HUGEPAGE);
+		}
+#endif
+		kind = ANONYMOUS_MAPPING;
+	}
+#endif
+	if (memory == nullptr)
+	{
+		memory = std::calloc(count_, sizeof(uint32));
+		kind = HEAP;
+	}
+	if (memory == nullptr)
+	{
+		kind = NONE;
+		throw std::bad_alloc();
+	}
+	elements = static_cast<uint32*>(memory);
+	count = count_;
+}
+
+TensorBuffer::~TensorBuffer()
+{
+	switch (kind)
+	{
+	case HEAP:
+		std::free(elements);
+		break;
+	case ANONYMOUS_MAPPING:
+	case FILE_MAPPING:
+#if ! JUCE_WINDOWS
+		munmap(elements, count * sizeof(uint32));
+#endif
+		break;
+	case NONE:
+		break;
+	}
+}
+
+void* TensorBuffer::mapFile(size_t bytes, const File& directory)
+{
+#if JUCE_WINDOWS
+	return nullptr;
+#else
+	directory.createDirectory();
+	std::string path = (directory.getFullPathName() + "/tensor-XXXXXX").toStdString();
+	int fd = mkstemp(&path[0]);
+	if (fd < 0)
+	{
+		std::cout << "TensorBuffer::mapFile(): cannot create a backing file in " << directory.getFullPathName() << std::endl;
+		return nullptr;
+	}
+	/* the mapping keeps the file alive; nothing is left behind after a crash */
+	unlink(path.c_str());
+	void* memory = nullptr;
+	if (ftruncate(fd, off_t(bytes)) == 0)
+	{
+		memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (memory == MAP_FAILED)
+		{
+			memory = nullptr;
+		}
+#ifdef MADV_HUGEPAGE
+		else
+		{
+			madvise(memory, bytes, MADV_HUGEPAGE); // honoured where the file system supports it
+		}
+#endif
+	}
+	close(fd);
+	return memory;
+#endif
+}
@@ -0,0 +1,99 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef TENSORBUFFER_H_DEFINED
+#define TENSORBUFFER_H_DEFINED
+
+#include <ProcessorHeaders.h>
+
+#include <limits>
+#include <utility>
+
+/**
+	Zero-filled, fixed-size array of counts backing a PSTHTensor, either
+	on the heap or in a memory-mapped file.
+
+	Heap buffers of a few MB and more are anonymous mappings advised for
+	transparent huge pages, so the TLB covers large tensors and untouched
+	capacity is never committed. Buffers projected past the policy's
+	threshold live in an unlinked temporary file instead: the file is grown
+	with ftruncate, so it stays sparse until rows are written, and cold pages
+	are written back to it rather than swapped, so a design larger than RAM
+	stays usable.
+
+	On platforms without POSIX mappings both kinds fall back to the heap.
+*/
+class TensorBuffer
+{
+public:
+	/** Which buffers go to a mapped file */
+	struct Policy
+	{
+		size_t mappedThreshold = std::numeric_limits<size_t>::max(); // bytes
+		File directory; // where the backing files are created
+	};
+
+	TensorBuffer() {}
+	TensorBuffer(size_t count, const Policy& policy);
+	~TensorBuffer();
+
+	TensorBuffer(TensorBuffer&& other) noexcept { swap(other); }
+	TensorBuffer& operator=(TensorBuffer&& other) noexcept
+	{
+		TensorBuffer released(std::move(other));
+		swap(released);
+		return *this;
+	}
+
+	void swap(TensorBuffer& other) noexcept
+	{
+		std::swap(elements, other.elements);
+		std::swap(count, other.count);
+		std::swap(kind, other.kind);
+	}
+
+	uint32* data() { return elements; }
+	const uint32* data() const { return elements; }
+	uint32* begin() { return elements; }
+	uint32* end() { return elements + count; }
+	const uint32* begin() const { return elements; }
+	const uint32* end() const { return elements + count; }
+	size_t size() const { return count; }
+
+	/** True if the buffer lives in a file rather than in memory */
+	bool isFileBacked() const { return kind == FILE_MAPPING; }
+
+private:
+	enum Kind { NONE, HEAP, ANONYMOUS_MAPPING, FILE_MAPPING };
+
+	/** Maps a sparse, already unlinked file of the given size; nullptr on failure */
+	static void* mapFile(size_t bytes, const File& directory);
+
+	uint32* elements = nullptr;
+	size_t count = 0;
+	Kind kind = NONE;
+
+	JUCE_DECLARE_NON_COPYABLE(TensorBuffer);
+};
+
+#endif // TENSORBUFFER_H_DEFINED
@@ -0,0 +1,53 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "TrialEvent.h"
+
+static uint64 readLittleEndian(const uint8* p, int n_bytes)
+{
+	uint64 value = 0;
+	for (int i = n_bytes - 1; i >= 0; i--)
+	{
+		value = (value << 8) | p[i];
+	}
+	return value;
+}
+
+bool TrialEvent::decode(const void* data, size_t size, TrialEvent& event)
+{
+	const uint8* p = static_cast<const uint8*>(data);
+	if (size < headerSize || p[0] != magic || p[1] != version)
+	{
+		return false;
+	}
+	if (p[2] < CLEAR_DESIGN || p[2] > SET_DESIGN)
+	{
+		return false;
+	}
+	event.type = Type(p[2]);
+	event.id = uint32(readLittleEndian(p + 4, 4));
+	event.senderTime = int64(readLittleEndian(p + 8, 8));
+	event.payload = p + headerSize;
+	event.payloadSize = int(size - headerSize);
+	return true;
+}
@@ -0,0 +1,77 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef TRIALEVENT_H_DEFINED
+#define TRIALEVENT_H_DEFINED
+
+#include <ProcessorHeaders.h>
+
+/**
+	Binary trial event, the compact alternative to the Kofiko text messages.
+
+	Wire layout (little-endian, 16 bytes, any number of trailing bytes):
+
+		0   uint8   magic, 0xB5 (never the first byte of a text message)
+		1   uint8   version, 1
+		2   uint8   type
+		3   uint8   reserved, 0
+		4   uint32  id
+		8   int64   sender timestamp (us, sender's clock)
+		16  ...     AddCondition: UTF-8 condition name (optional)
+		            SetDesign: UTF-8 condition names, one per line (optional)
+
+	Ids are interned by the sender: AddCondition declares stim class id,
+	which must be the next free one (classes are numbered in the order they
+	are added), and TrialStart / TrialType name the stim class of the trial
+	directly instead of an image id. SetDesign replaces the design with id
+	conditions in one step. The id of the other types is ignored.
+*/
+struct TrialEvent
+{
+	enum Type
+	{
+		CLEAR_DESIGN = 1,
+		ADD_CONDITION = 2,
+		TRIAL_START = 3,
+		TRIAL_TYPE = 4,
+		TRIAL_ALIGN = 5,
+		TRIAL_END = 6,
+		SET_DESIGN = 7
+	};
+
+	static const uint8 magic = 0xB5;
+	static const uint8 version = 1;
+	static const int headerSize = 16;
+
+	Type type = CLEAR_DESIGN;
+	uint32 id = 0;
+	int64 senderTime = 0;
+	const uint8* payload = nullptr; // trailing bytes, inside the received message
+	int payloadSize = 0;
+
+	/** Decodes a message in place, without allocating. Returns false if it is
+		not a binary event of a known version and type (e.g. a text message) */
+	static bool decode(const void* data, size_t size, TrialEvent& event);
+};
+
+#endif // TRIALEVENT_H_DEFINED
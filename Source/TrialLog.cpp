@@ -0,0 +1,241 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#include "TrialLog.h"
+
+#include <algorithm>
+#include <cstring>
+
+TrialLog::TrialLog()
+{
+	scratch.reserve(4096);
+}
+
+void TrialLog::writeVarint(std::vector<uint8>& out, uint64 value)
+{
+	while (value >= 0x80)
+	{
+		out.push_back(uint8(value) | 0x80);
+		value >>= 7;
+	}
+	out.push_back(uint8(value));
+}
+
+/* Reads a varint that ends before end and fits in 64 bits; false otherwise */
+static bool readBoundedVarint(const uint8*& p, const uint8* end, uint64& value)
+{
+	value = 0;
+	for (int shift = 0; shift < 64; shift += 7)
+	{
+		if (p == end)
+		{
+			return false;
+		}
+		uint8 byte = *p++;
+		value |= uint64(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool TrialLog::isValidRecord(const uint8* record, size_t length, int n_conditions)
+{
+	const uint8* p = record;
+	const uint8* end = record + length;
+	uint64 stimClass, nGroups;
+	if (!readBoundedVarint(p, end, stimClass) || stimClass >= uint64(jmax(n_conditions, 0)) || p == end)
+	{
+		return false;
+	}
+	p++; // flags
+	if (!readBoundedVarint(p, end, nGroups))
+	{
+		return false;
+	}
+	uint64 channel = 0;
+	for (uint64 g = 0; g < nGroups; g++)
+	{
+		uint64 delta, unit, stream, count;
+		if (!readBoundedVarint(p, end, delta) || !readBoundedVarint(p, end, unit) || !readBoundedVarint(p, end, stream) || !readBoundedVarint(p, end, count))
+		{
+			return false;
+		}
+		channel += jmin(delta, uint64(maxId));
+		/* every spike takes at least a byte, which bounds count before the loop */
+		if (channel >= uint64(maxId) || unit >= uint64(maxId) || stream >= uint64(maxId)
+			|| count == 0 || count > uint64(end - p))
+		{
+			return false;
+		}
+		int64 offset = 0;
+		for (uint64 i = 0; i < count; i++)
+		{
+			uint64 z;
+			if (!readBoundedVarint(p, end, z))
+			{
+				return false;
+			}
+			if (i == 0)
+			{
+				if (z >= uint64(maxOffset) * 2)
+				{
+					return false;
+				}
+				offset = int64(z >> 1) ^ -int64(z & 1);
+			}
+			else
+			{
+				if (z > uint64(maxOffset) - uint64(offset))
+				{
+					return false;
+				}
+				offset += int64(z);
+			}
+		}
+	}
+	return p == end;
+}
+
+void TrialLog::append(int stim_class, bool sample_clock, std::vector<Spike>& spikes)
+{
+	std::sort(spikes.begin(), spikes.end(), [](const Spike& a, const Spike& b)
+		{
+			if (a.channelIdx != b.channelIdx) return a.channelIdx < b.channelIdx;
+			if (a.sortedId != b.sortedId) return a.sortedId < b.sortedId;
+			if (a.streamId != b.streamId) return a.streamId < b.streamId;
+			return a.offset < b.offset;
+		});
+
+	scratch.clear();
+	writeVarint(scratch, stim_class);
+	scratch.push_back(sample_clock ? 1 : 0);
+
+	uint64 nGroups = 0;
+	for (size_t i = 0; i < spikes.size(); i++)
+	{
+		if (i == 0 || spikes[i].channelIdx != spikes[i - 1].channelIdx
+			|| spikes[i].sortedId != spikes[i - 1].sortedId || spikes[i].streamId != spikes[i - 1].streamId)
+		{
+			nGroups++;
+		}
+	}
+	writeVarint(scratch, nGroups);
+
+	int previousChannel = 0;
+	size_t i = 0;
+	while (i < spikes.size())
+	{
+		size_t end = i + 1;
+		while (end < spikes.size() && spikes[end].channelIdx == spikes[i].channelIdx
+			&& spikes[end].sortedId == spikes[i].sortedId && spikes[end].streamId == spikes[i].streamId)
+		{
+			end++;
+		}
+		writeVarint(scratch, spikes[i].channelIdx - previousChannel);
+		writeVarint(scratch, spikes[i].sortedId);
+		writeVarint(scratch, spikes[i].streamId);
+		writeVarint(scratch, end - i);
+		int64 first = spikes[i].offset;
+		writeVarint(scratch, (uint64(first) << 1) ^ uint64(first >> 63)); // zigzag: pre-stimulus offsets are negative
+		for (size_t j = i + 1; j < end; j++)
+		{
+			writeVarint(scratch, spikes[j].offset - spikes[j - 1].offset);
+		}
+		previousChannel = spikes[i].channelIdx;
+		i = end;
+	}
+
+	appendRecord(stim_class, sample_clock, scratch.data(), scratch.size());
+}
+
+void TrialLog::appendRecord(int stim_class, bool sample_clock, const uint8* data, size_t length)
+{
+	if (chunks.empty() || chunkCapacity - chunkUsed < length)
+	{
+		chunkCapacity = std::max(chunkSize, length);
+		chunks.push_back(std::shared_ptr<uint8>(new uint8[chunkCapacity], std::default_delete<uint8[]>()));
+		chunkEnds.push_back(getNumTrials());
+		chunkUsed = 0;
+	}
+	uint8* record = chunks.back().get() + chunkUsed;
+	std::memcpy(record, data, length);
+	chunkUsed += length;
+	numBytes += length;
+
+	trials.push_back({ stim_class, sample_clock, record, length });
+	chunkEnds.back() = getNumTrials();
+	if (numBytes > maxBytes)
+	{
+		trim();
+	}
+}
+
+void TrialLog::trim()
+{
+	/* whole chunks go, so the records left never move; the newest chunk stays */
+	size_t dropped = 0;
+	while (numBytes > maxBytes && chunks.size() > 1)
+	{
+		for (; firstTrial < chunkEnds.front(); firstTrial++)
+		{
+			numBytes -= trials.front().length;
+			trials.pop_front();
+			dropped++;
+		}
+		chunks.erase(chunks.begin());
+		chunkEnds.erase(chunkEnds.begin());
+	}
+	if (dropped > 0 && !trimmed)
+	{
+		trimmed = true;
+		std::cout << "TrialLog::trim(): log reached " << (maxBytes >> 20) << " MB; dropping the oldest trials, "
+			<< "rebins now cover trial " << firstTrial << " on" << std::endl;
+	}
+}
+
+TrialLog::Snapshot TrialLog::snapshot(int first_trial) const
+{
+	Snapshot s;
+	s.chunks = chunks;
+	s.firstTrial = jmax(first_trial, firstTrial);
+	if (s.firstTrial < getNumTrials())
+	{
+		s.trials.assign(trials.begin() + (s.firstTrial - firstTrial), trials.end());
+	}
+	return s;
+}
+
+void TrialLog::clear()
+{
+	chunks.clear();
+	chunkEnds.clear();
+	trials.clear();
+	firstTrial = 0;
+	chunkUsed = 0;
+	chunkCapacity = 0;
+	numBytes = 0;
+	trimmed = false;
+}
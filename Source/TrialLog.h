@@ -0,0 +1,185 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#ifndef TRIALLOG_H_DEFINED
+#define TRIALLOG_H_DEFINED
+
+#include <ProcessorHeaders.h>
+
+#include <deque>
+#include <limits>
+#include <memory>
+#include <vector>
+
+/**
+	Append-only log of the committed trials' spike offsets, so histograms
+	can be recomputed exactly for any bin layout.
+
+	Each trial is stored as one contiguous record in a chunked arena:
+
+		varint stim class, byte flags, varint number of groups
+		per (channel, unit, stream) group, sorted:
+			varint channel delta, varint unit, varint stream, varint count,
+			zigzag varint first offset, varint offset deltas
+
+	Offsets are in ms, or in samples of the group's stream for trials aligned
+	on the sample clock. A spike costs a few bytes, most of them the offset delta.
+
+	Chunks are reference counted and never move, so a Snapshot taken on the
+	writer thread can be decoded on another thread while the log keeps growing
+	(or is cleared).
+
+	The log is capped at setMaxBytes(): past it, the oldest chunks are dropped
+	with their trials, so memory and the index copied into each Snapshot stay
+	bounded over long sessions, and a rebin then covers the trials still held.
+	Trials keep their index, counted from the first trial since clear().
+*/
+class TrialLog
+{
+public:
+	struct Spike
+	{
+		int channelIdx;
+		int sortedId;
+		int streamId;
+		int64 offset; // from TrialAlign: ms, or samples of streamId for sample-clock trials
+	};
+
+	struct Trial
+	{
+		int stimClass;
+		bool sampleClock;
+		const uint8* data; // the record, inside one chunk
+		size_t length;
+	};
+
+	/** A consistent, immutable range of the log */
+	struct Snapshot
+	{
+		std::vector<std::shared_ptr<uint8>> chunks; // keeps the records alive
+		std::vector<Trial> trials;
+		int firstTrial = 0; // index of trials[0]
+	};
+
+	TrialLog();
+
+	/** Encodes and appends a trial. spikes is sorted in place */
+	void append(int stim_class, bool sample_clock, std::vector<Spike>& spikes);
+
+	/** Appends a record encoded by append(), e.g. read back from a session file */
+	void appendRecord(int stim_class, bool sample_clock, const uint8* record, size_t length);
+
+	/** True if [record, record + length) is exactly one record as append() encodes it,
+		with a stim class below n_conditions, channel, unit and stream ids below maxId
+		and offsets within +-maxOffset, so decode() can read it safely. For records
+		from outside, e.g. a session file */
+	static bool isValidRecord(const uint8* record, size_t length, int n_conditions);
+
+	static const int64 maxId = 1 << 16;
+	static const int64 maxOffset = int64(1) << 62;
+
+	/** Copies out the index of the trials held from first_trial on */
+	Snapshot snapshot(int first_trial = 0) const;
+
+	/** Calls callback(const Spike&) for every spike of a trial */
+	template <typename Callback>
+	static void decode(const Trial& trial, Callback&& callback)
+	{
+		const uint8* p = trial.data;
+		readVarint(p); // stim class
+		p++; // flags
+		uint64 nGroups = readVarint(p);
+		Spike spike{ 0, 0, 0, 0 };
+		for (uint64 g = 0; g < nGroups; g++)
+		{
+			spike.channelIdx += (int)readVarint(p);
+			spike.sortedId = (int)readVarint(p);
+			spike.streamId = (int)readVarint(p);
+			uint64 count = readVarint(p);
+			for (uint64 i = 0; i < count; i++)
+			{
+				if (i == 0)
+				{
+					uint64 z = readVarint(p);
+					spike.offset = int64(z >> 1) ^ -int64(z & 1);
+				}
+				else
+				{
+					spike.offset += (int64)readVarint(p);
+				}
+				callback(spike);
+			}
+		}
+	}
+
+	/** Index past the last trial: the number of trials appended since clear() */
+	int getNumTrials() const { return firstTrial + (int)trials.size(); }
+
+	/** Index of the oldest trial still held; trials before it were dropped at the cap */
+	int getFirstTrial() const { return firstTrial; }
+
+	/** A trial held by the log, by index in [getFirstTrial(), getNumTrials()) */
+	const Trial& getTrial(int index) const { return trials[index - firstTrial]; }
+	size_t getNumBytes() const { return numBytes; }
+
+	/** Caps the records held; the oldest chunks are dropped at the next append past it */
+	void setMaxBytes(size_t max_bytes) { maxBytes = max_bytes; }
+
+	/** Drops every trial. Snapshots already taken stay valid */
+	void clear();
+
+private:
+	static uint64 readVarint(const uint8*& p)
+	{
+		uint64 value = 0;
+		int shift = 0;
+		uint8 byte;
+		do
+		{
+			byte = *p++;
+			value |= uint64(byte & 0x7f) << shift;
+			shift += 7;
+		} while (byte & 0x80);
+		return value;
+	}
+
+	static void writeVarint(std::vector<uint8>& out, uint64 value);
+
+	/** Drops the oldest chunks, and their trials, until the log fits maxBytes */
+	void trim();
+
+	static constexpr size_t chunkSize = 1 << 16;
+
+	std::vector<std::shared_ptr<uint8>> chunks;
+	std::vector<int> chunkEnds; // per chunk: index past its last trial
+	size_t chunkUsed = 0; // bytes used in chunks.back()
+	size_t chunkCapacity = 0; // size of chunks.back()
+	std::deque<Trial> trials;
+	int firstTrial = 0;
+	std::vector<uint8> scratch; // encode buffer, reused across trials
+	size_t numBytes = 0; // in records held
+	size_t maxBytes = std::numeric_limits<size_t>::max();
+	bool trimmed = false; // since clear(), for a one-time report
+};
+
+#endif // TRIALLOG_H_DEFINED
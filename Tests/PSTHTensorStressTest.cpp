@@ -0,0 +1,151 @@
+/*
+	------------------------------------------------------------------
+
+	This file is part of the Open Ephys GUI
+	Copyright (C) 2022 Open Ephys
+
+	------------------------------------------------------------------
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+	A reader thread reads random rows, in range and out of it, while the
+	writer keeps growing, re-laying out, zeroing and clearing the tensor.
+	The reader must never crash or read outside a buffer (build with
+	-fsanitize=address to check the latter), and a view that survived its
+	ReadScope must be self-consistent: prefix sums never decrease, and no
+	bin holds more spikes than were ever added.
+
+		g++ -std=c++17 -O2 -fsanitize=address -I<includes> Tests/PSTHTensorStressTest.cpp Source/PSTHTensor.cpp Source/TensorBuffer.cpp
+*/
+
+#include "../Source/PSTHTensor.h"
+
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+#include <random>
+#include <thread>
+
+int main()
+{
+	const int spikesPerRow = 8; // per addSpikes() call
+	const auto duration = std::chrono::seconds(5);
+	PSTHTensor tensor;
+	std::atomic<bool> done{ false };
+	std::atomic<uint64> maxCount{ 0 }; // upper bound on any bin, raised before the spikes are added
+	std::atomic<int> failures{ 0 };
+	std::atomic<uint64> views{ 0 };
+
+	std::thread reader([&]()
+		{
+			std::mt19937 rng(2);
+			while (!done.load())
+			{
+				PSTHTensor::ReadScope read(tensor);
+				bool consistent;
+				do
+				{
+					consistent = true;
+					for (int i = 0; i < 64; i++)
+					{
+						PSTHTensor::HistogramView view = tensor.getView(int(rng() % 40) - 2, int(rng() % 12) - 2, int(rng() % 20) - 2);
+						if (view.cumulative == nullptr)
+						{
+							continue;
+						}
+						uint64 limit = maxCount.load();
+						for (int bin = 0; bin < view.nBins; bin++)
+						{
+							uint32 count = view.getCount(bin);
+							double variance = view.getCountVariance(bin);
+							consistent = consistent && count <= limit && variance >= 0;
+						}
+						views++;
+					}
+				} while (read.retry());
+				if (!consistent)
+				{
+					failures++;
+				}
+			}
+		});
+
+	std::mt19937 rng(1);
+	PSTHBinning binning;
+	binning.binSize = 1;
+	binning.nBins = 100;
+	binning.preBins = 20;
+	tensor.setBinning(binning);
+	int bins[spikesPerRow];
+	uint64 added = 0;
+	auto start = std::chrono::steady_clock::now();
+	for (int iteration = 0; std::chrono::steady_clock::now() - start < duration; iteration++)
+	{
+		switch (rng() % 64)
+		{
+		case 0:
+			tensor.zero();
+			break;
+		case 1:
+			tensor.clear();
+			break;
+		case 2:
+			binning.nBins = 50 + int(rng() % 150);
+			tensor.setBinning(binning);
+			break;
+		case 3:
+		{
+			PSTHBinning display = binning;
+			display.binSize = 2;
+			display.nBins = binning.nBins / 2;
+			display.preBins = binning.preBins / 2;
+			tensor.setDisplayBinning(display);
+			break;
+		}
+		case 4:
+			tensor.setNumConditions(int(rng() % 16));
+			break;
+		default:
+		{
+			int channel = int(rng() % 36);
+			int unit = int(rng() % 8);
+			if (tensor.getNumConditions() == 0)
+			{
+				tensor.setNumConditions(1 + int(rng() % 16));
+			}
+			int stimClass = int(rng() % tensor.getNumConditions());
+			tensor.ensure(channel, unit);
+			for (int i = 0; i < spikesPerRow; i++)
+			{
+				bins[i] = int(rng() % tensor.getBaseBinning().getRowLength());
+			}
+			std::sort(bins, bins + spikesPerRow);
+			added += spikesPerRow;
+			maxCount.store(added);
+			PSTHTensor::WriteScope write(tensor);
+			tensor.addSpikes(channel, unit, stimClass, bins, spikesPerRow);
+			tensor.addTrial(stimClass);
+			break;
+		}
+		}
+	}
+	done.store(true);
+	reader.join();
+
+	std::printf("%llu views read, %d inconsistent\n", (unsigned long long)views.load(), failures.load());
+	return failures.load() == 0 && views.load() > 0 ? 0 : 1;
+}